@@ -1,6 +1,7 @@
 #ifndef CANVAS_H
 #define CANVAS_H
 
+#include "output.h"
 #include "primitive.h"
 #include <fcntl.h>
 #include <stdio.h>
@@ -12,63 +13,71 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+const int CANVAS_ROW_MAJOR = 0;
+const int CANVAS_TILED = 1;
+
+// Edge length of a tile in the tiled layout. A 16x16 tile of Vec3 is exactly 48 cache lines, so
+// workers that own whole tiles never share a line with each other.
+const int CANVAS_TILE_SIZE = 16;
+
+struct Canvas;
+
+struct CanvasRow {
+    Canvas &canvas;
+    int row;
+    Vec3 &operator[](int col) const;
+};
+
+struct ConstCanvasRow {
+    const Canvas &canvas;
+    int row;
+    const Vec3 &operator[](int col) const;
+};
+
 struct Canvas {
   public:
     int width, height;
+    int layout = CANVAS_ROW_MAJOR;
+    int tiles_x, tiles_y;
+    size_t allocated;
     Vec3 *buffer;
 
-    Canvas(int rows, int cols) : width(cols), height(rows) {
-        buffer = new Vec3[width * height];
-        memset(buffer, 0, width * height * sizeof(Vec3));
-    }
-    ~Canvas() { delete[] buffer; }
-    Vec3 *operator[](int row) { return &buffer[row * width]; }
-    void write_ppm(char *ppm_file) {
-        // Set up header
-        char *header;
-        asprintf(&header, "P6 %d %d 255\n", width, height);
-
-        // Compute file size
-        long long header_sz = strlen(header);
-        long long length = header_sz + width * height * 3 ;
-
-        // Open fd
-        int fd = open(ppm_file, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-        if (fd == -1) {
-            fprintf(stderr, "Could not open file %s!\n", ppm_file);
+    // The buffer is mapped lazily and zero-filled by the kernel, so the first thread to touch a page
+    // decides which NUMA node it lives on (see place_canvas).
+    Canvas(int rows, int cols, int layout = CANVAS_ROW_MAJOR) : width(cols), height(rows), layout(layout) {
+        tiles_x = (width + CANVAS_TILE_SIZE - 1) / CANVAS_TILE_SIZE;
+        tiles_y = (height + CANVAS_TILE_SIZE - 1) / CANVAS_TILE_SIZE;
+        size_t pixels = layout == CANVAS_TILED ? (size_t)tiles_x * tiles_y * CANVAS_TILE_SIZE * CANVAS_TILE_SIZE : (size_t)width * height;
+        allocated = pixels * sizeof(Vec3);
+        buffer = (Vec3 *)mmap(nullptr, allocated, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer == MAP_FAILED) {
+            fprintf(stderr, "Could not allocate %dx%d canvas!\n", width, height);
             exit(-1);
         }
-
-        // create buffer
-        unsigned char *file = (unsigned char*) calloc(length+1, sizeof(unsigned char));
-
-        // write headers        
-        memcpy(file, header, header_sz);
-
-        // write imdata
-        unsigned char *bblob = file + header_sz;
-        for (int i = 0; i < height; i++) {
-            for (int j = 0; j < width; j++) {
-                const Vec3 &rgb = (*this)[i][j];
-                unsigned char r, g, b;
-                r = rgb.x * 255;
-                g = rgb.y * 255;
-                b = rgb.z * 255;
-                int ind = (i * width + j) * 3;
-                bblob[ind] = r;
-                bblob[ind + 1] = g;
-                bblob[ind + 2] = b;
-            }
+    }
+    Canvas(const Canvas &) = delete;
+    ~Canvas() { munmap(buffer, allocated); }
+    size_t index(int row, int col) const {
+        if (layout == CANVAS_ROW_MAJOR) {
+            return (size_t)row * width + col;
         }
-
-        // close file
-        write(fd, file, length); 
-        close(fd);
-
-        // free buffers
-        free(header);
-        free(file);
+        int tile = (row / CANVAS_TILE_SIZE) * tiles_x + col / CANVAS_TILE_SIZE;
+        return (size_t)tile * CANVAS_TILE_SIZE * CANVAS_TILE_SIZE + (row % CANVAS_TILE_SIZE) * CANVAS_TILE_SIZE + col % CANVAS_TILE_SIZE;
+    }
+    // Each row of tiles occupies one contiguous range of the buffer in either layout.
+    Vec3 *tile_row_begin(int tile_row) const {
+        return buffer + (layout == CANVAS_TILED ? (size_t)tile_row * tiles_x * CANVAS_TILE_SIZE * CANVAS_TILE_SIZE
+                                                : (size_t)tile_row * CANVAS_TILE_SIZE * width);
     }
+    Vec3 *tile_row_end(int tile_row) const {
+        return tile_row + 1 >= tiles_y ? (Vec3 *)((char *)buffer + allocated) : tile_row_begin(tile_row + 1);
+    }
+    CanvasRow operator[](int row) { return CanvasRow{*this, row}; }
+    ConstCanvasRow operator[](int row) const { return ConstCanvasRow{*this, row}; }
+    bool write_ppm(const char *ppm_file) const { return write_image(*this, ppm_file, IMAGE_PPM); }
 };
 
-#endif
\ No newline at end of file
+inline Vec3 &CanvasRow::operator[](int col) const { return canvas.buffer[canvas.index(row, col)]; }
+inline const Vec3 &ConstCanvasRow::operator[](int col) const { return canvas.buffer[canvas.index(row, col)]; }
+
+#endif
@@ -0,0 +1,95 @@
+#include "irradiance.h"
+#include <algorithm>
+#include <mutex>
+
+unsigned int cell_hash(int x, int y, int z) { return (x * 73856093u) ^ (y * 19349663u) ^ (z * 83492791u); }
+
+// Buckets of the position's cell and of the seven cells nearest to it, which hold every sample whose
+// radius can reach it. The position's own bucket comes first. Returns the number of distinct buckets.
+int IrradianceCache::neighbour_buckets(const Vec3 &position, int *found) const {
+    Vec3 scaled = position / max_radius;
+    int cell[3] = {(int)floor(scaled.x), (int)floor(scaled.y), (int)floor(scaled.z)};
+    int step[3] = {scaled.x - cell[0] < 0.5 ? -1 : 1, scaled.y - cell[1] < 0.5 ? -1 : 1, scaled.z - cell[2] < 0.5 ? -1 : 1};
+    int count = 0;
+    for (int corner = 0; corner < 8; corner++) {
+        int x = cell[0] + (corner & 1 ? step[0] : 0);
+        int y = cell[1] + (corner & 2 ? step[1] : 0);
+        int z = cell[2] + (corner & 4 ? step[2] : 0);
+        int bucket = cell_hash(x, y, z) & (IRRADIANCE_BUCKETS - 1);
+        if (std::find(found, found + count, bucket) == found + count) {
+            found[count++] = bucket;
+        }
+    }
+    return count;
+}
+
+// Ward's weight: inverse of the distance in radii plus the divergence of the normals.
+float IrradianceCache::weight(const IrradianceSample &sample, const Vec3 &position, const Vec3 &normal) const {
+    float divergence = (position - sample.position).magnitude() / sample.radius + sqrt(fmax(0.0f, 1 - (normal ^ sample.normal)));
+    return divergence > 1e-6 ? 1 / divergence : 1e6;
+}
+
+// Weighted average of the mesh's samples valid at the position, if there are any. Samples whose shadow
+// rays disagree with the ones the caller tested lie across a shadow edge and are skipped.
+bool IrradianceCache::lookup(int mesh_id, const Vec3 &position, const Vec3 &normal, const LightVisibilityMask &visibility,
+                             Vec3 &irradiance) {
+    int found[8];
+    int count = neighbour_buckets(position, found);
+    Vec3 weighted;
+    float total = 0;
+    for (int b = 0; b < count; b++) {
+        std::shared_lock<std::shared_mutex> lock(buckets[found[b]].lock);
+        for (const IrradianceSample &sample : buckets[found[b]].samples) {
+            if (sample.mesh_id != mesh_id || ((sample.visible ^ visibility.visible) & visibility.tested) != 0) {
+                continue;
+            }
+            float w = weight(sample, position, normal);
+            if (w > 1 / error) {
+                weighted = weighted + sample.irradiance * w;
+                total += w;
+            }
+        }
+    }
+    if (total <= 0) {
+        return false;
+    }
+    irradiance = weighted / total;
+    return true;
+}
+
+// Overlapping samples bound each other's radii by the gradient between them: at a radii of distance,
+// the largest reuse Ward's weight allows, the extrapolated relative error stays below a.
+void IrradianceCache::insert(int mesh_id, const Vec3 &position, const Vec3 &normal, unsigned long long visible, const Vec3 &irradiance,
+                             float radius) {
+    radius = fmin(fmax(radius, min_radius), max_radius);
+    int found[8];
+    int count = neighbour_buckets(position, found);
+    for (int b = 0; b < count; b++) {
+        std::lock_guard<std::shared_mutex> lock(buckets[found[b]].lock);
+        for (IrradianceSample &sample : buckets[found[b]].samples) {
+            float distance = (position - sample.position).magnitude();
+            if (sample.mesh_id != mesh_id || distance >= fmax(radius, sample.radius) || (normal ^ sample.normal) < 1 - error) {
+                continue;
+            }
+            Vec3 difference = sample.irradiance - irradiance;
+            float magnitude = fabs(difference.x) + fabs(difference.y) + fabs(difference.z);
+            float mean = (sample.irradiance.sum() + irradiance.sum()) / 2;
+            if (magnitude > 0 && mean > 0) {
+                float limit = fmax(distance * mean / magnitude, min_radius);
+                sample.radius = fmin(sample.radius, limit);
+                radius = fmin(radius, limit);
+            }
+        }
+    }
+    std::lock_guard<std::shared_mutex> lock(buckets[found[0]].lock);
+    buckets[found[0]].samples.push_back(IrradianceSample{mesh_id, visible, position, normal, irradiance, radius});
+}
+
+size_t IrradianceCache::size() {
+    size_t samples = 0;
+    for (Bucket &bucket : buckets) {
+        std::shared_lock<std::shared_mutex> lock(bucket.lock);
+        samples += bucket.samples.size();
+    }
+    return samples;
+}
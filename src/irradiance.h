@@ -0,0 +1,55 @@
+#ifndef IRRADIANCE_H
+#define IRRADIANCE_H
+
+#include "primitive.h"
+#include <shared_mutex>
+#include <vector>
+
+using std::vector;
+
+// Ward's a: samples are reused while distance / radius + normal divergence stays below it. Also the
+// relative error allowed when sizing radii. At most 0.5, or lookups would need more than 8 grid cells.
+const float IRRADIANCE_ERROR = 0.2;
+// Validity radii are clamped to this range, and the hash grid uses the largest as its cell size. Point
+// lights cast hard shadow edges that no radius estimate sees coming, so the largest radius bounds how far
+// past an edge a sample can be reused.
+const float IRRADIANCE_MIN_RADIUS = 0.02;
+const float IRRADIANCE_MAX_RADIUS = 0.5;
+const int IRRADIANCE_BUCKETS = 1 << 12;
+
+// Shadow-ray outcomes at a point, one bit per (light, mesh) pair for the first 64 pairs
+struct LightVisibilityMask {
+    unsigned long long tested = 0, visible = 0;
+};
+
+// Positions and normals are in the hit's mesh space, as shading sees them, so samples only serve the
+// mesh they were taken on.
+struct IrradianceSample {
+    int mesh_id;
+    unsigned long long visible; // Every pair's outcome at the sample
+    Vec3 position, normal;
+    Vec3 irradiance;
+    float radius;
+};
+
+// Lazily filled cache of direct irradiance (before surface color), shared by every render thread. Each
+// grid cell hashes to one of IRRADIANCE_BUCKETS stripes with its own lock.
+struct IrradianceCache {
+    float error = IRRADIANCE_ERROR;
+    float min_radius = IRRADIANCE_MIN_RADIUS;
+    float max_radius = IRRADIANCE_MAX_RADIUS;
+
+    struct Bucket {
+        std::shared_mutex lock;
+        vector<IrradianceSample> samples;
+    };
+    vector<Bucket> buckets = vector<Bucket>(IRRADIANCE_BUCKETS);
+
+    int neighbour_buckets(const Vec3 &position, int *found) const;
+    float weight(const IrradianceSample &sample, const Vec3 &position, const Vec3 &normal) const;
+    bool lookup(int mesh_id, const Vec3 &position, const Vec3 &normal, const LightVisibilityMask &visibility, Vec3 &irradiance);
+    void insert(int mesh_id, const Vec3 &position, const Vec3 &normal, unsigned long long visible, const Vec3 &irradiance, float radius);
+    size_t size();
+};
+
+#endif
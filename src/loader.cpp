@@ -0,0 +1,45 @@
+#include "loader.h"
+
+using std::chrono::steady_clock;
+
+// Parse and build every mesh as its own pool task, so a scene costs its slowest asset rather than
+// the sum of all of them.
+vector<future<Mesh>> load_meshes_async(ThreadPool &pool, const vector<MeshSource> &sources) {
+    auto loaded = std::make_shared<atomic<int>>(0);
+    int total = sources.size();
+    vector<future<Mesh>> meshes;
+    for (const MeshSource &source : sources) {
+        meshes.push_back(pool.submit([source, loaded, total] {
+            steady_clock::time_point start = steady_clock::now();
+            Mesh mesh(source.obj_file, source.ior, source.matte, source.shiny, source.scattering, source.octree_budget);
+            if (source.lod_levels > 0) {
+                mesh.build_lods(source.lod_levels);
+            }
+            float seconds = std::chrono::duration<float>(steady_clock::now() - start).count();
+            printf("[%d/%d] Loaded %s (%zu faces, %.1f KB) in %f seconds\n", ++*loaded, total, source.obj_file, mesh.faces.size(),
+                   mesh.memory_usage().total() / 1024.0, seconds);
+            return mesh;
+        }));
+    }
+    return meshes;
+}
+
+// Move finished meshes into the scene in submission order.
+void wait_meshes(Scene &scene, vector<future<Mesh>> &meshes) {
+    scene.meshes.reserve(scene.meshes.size() + meshes.size());
+    for (future<Mesh> &mesh : meshes) {
+        scene.meshes.push_back(mesh.get());
+    }
+    meshes.clear();
+}
+
+void load_scene(Scene &scene, ThreadPool &pool, const vector<MeshSource> &sources) {
+    steady_clock::time_point start = steady_clock::now();
+    vector<future<Mesh>> meshes = load_meshes_async(pool, sources);
+    wait_meshes(scene, meshes);
+    printf("Loaded %zu meshes in %f seconds\n", sources.size(), std::chrono::duration<float>(steady_clock::now() - start).count());
+    for (size_t i = 0; i < sources.size(); i++) {
+        scene.meshes[scene.meshes.size() - sources.size() + i].memory_usage().print(sources[i].obj_file);
+    }
+    memory_usage(scene).print("Scene");
+}
@@ -0,0 +1,18 @@
+#ifndef LOADER_H
+#define LOADER_H
+
+#include "render.h"
+#include "threadpool.h"
+
+struct MeshSource {
+    char *obj_file;
+    float ior, matte, shiny, scattering;
+    size_t octree_budget = 0;
+    int lod_levels = 0; // Coarser levels to build for render-time LOD selection, 0 for none
+};
+
+vector<future<Mesh>> load_meshes_async(ThreadPool &pool, const vector<MeshSource> &sources);
+void wait_meshes(Scene &scene, vector<future<Mesh>> &meshes);
+void load_scene(Scene &scene, ThreadPool &pool, const vector<MeshSource> &sources);
+
+#endif
@@ -1,11 +1,16 @@
 #include "canvas.hpp"
+#include "loader.h"
 #include "mesh.h"
 #include "render.h"
 
 int main() {
     Scene scene;
-    scene.meshes.push_back(Mesh((char *)"obj/cow.obj", 1.5, 0.03, 1, 1));
-    scene.meshes.push_back(Mesh((char *)"obj/plane.obj", 4, 0.25, 1, 1));
+    ThreadPool pool;
+    load_scene(scene, pool,
+               {
+                   {(char *)"obj/cow.obj", 1.5, 0.03, 1, 1},
+                   {(char *)"obj/plane.obj", 4, 0.25, 1, 1},
+               });
     for (int i = -9; i < 10; i++) {
         scene.lights.push_back(Light(Vec3(i, 5, i), Vec3(1, 1, 1)));
     }
@@ -16,4 +21,4 @@ int main() {
     Canvas canvas(80, 80);
     render(canvas, scene);
     canvas.write_ppm((char *)"img.ppm");
-}
\ No newline at end of file
+}
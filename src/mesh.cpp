@@ -1,12 +1,15 @@
 #include "mesh.h"
+#include "simplify.h"
 
-Mesh::Mesh(vector<Vec3> vertices, vector<Face> faces, vector<Vec3> colors, float ior, float matte, float shiny) {
+Mesh::Mesh(vector<Vec3> vertices, vector<Face> faces, vector<Vec3> colors, float ior, float matte, float shiny, size_t octree_budget) {
+    this->octree_budget = octree_budget;
     this->vertices = vertices;
     this->faces = faces;
     this->colors = colors;
     this->ior = ior;
     this->matte = matte;
     this->shiny = shiny;
+    build();
 }
 
 void parse_comment(char **line_start) {
@@ -148,7 +151,7 @@ void Mesh::read_file(char *obj_file) {
 }
 
 bool Mesh::reduce_octree(OctreeNode *node) {
-    if (node->total_faces < OCTREE_MINIMUM_FACES) {
+    if (node->total_faces < octree_min_faces) {
         node->contract();
         return true;
     }
@@ -161,7 +164,10 @@ bool Mesh::reduce_octree(OctreeNode *node) {
     return false;
 }
 
-Mesh::Mesh(char *obj_file, float ior, float matte, float shiny, float scattering) {
+Mesh::Mesh(char *obj_file, float ior, float matte, float shiny, float scattering) : Mesh(obj_file, ior, matte, shiny, scattering, 0) {}
+
+Mesh::Mesh(char *obj_file, float ior, float matte, float shiny, float scattering, size_t octree_budget) {
+    this->octree_budget = octree_budget;
     read_file(obj_file);
     this->ior = ior;
     this->matte = matte;
@@ -170,17 +176,46 @@ Mesh::Mesh(char *obj_file, float ior, float matte, float shiny, float scattering
 
     // Monocolor
     colors.push_back(Vec3(1, 1, 1));
+    for (Face &face : faces) {
+        face.c = 0;
+    }
 
-    // Build normals
     printf("Parsed %zu vertices and %zu faces from %s!\n", vertices.size(), faces.size(), obj_file);
+    build();
+}
+
+int material_class(float matte, float shiny, float scattering) {
+    int material = 0;
+    if (matte > 0) material |= MATERIAL_DIFFUSE;
+    if (shiny > 0) material |= MATERIAL_REFLECTIVE;
+    if (scattering > 0) material |= MATERIAL_REFRACTIVE;
+    return material;
+}
+
+void Mesh::build() {
+    // Build normals
+    normals.clear();
     for (Face &face : faces) {
         Vec3 l = vertices[face.v0] - vertices[face.v1]; // v0-v1
         Vec3 r = vertices[face.v2] - vertices[face.v1]; // v2-v1
         normals.push_back((l % r).normalize());
         face.normal = normals.size() - 1;
-        face.c = 0;
     }
 
+    build_octree();
+
+    // Trade traversal speed for memory until the octree fits its budget
+    while (octree_budget > 0 && memory_usage().acceleration() > octree_budget && octree_max_depth > 1) {
+        octree_max_depth = octree_max_depth > 2 ? octree_max_depth - 2 : 1;
+        octree_min_faces *= 2;
+        build_octree();
+    }
+    if (octree_budget > 0 && memory_usage().acceleration() > octree_budget) {
+        fprintf(stderr, "Octree needs %zu bytes, over its budget of %zu!\n", memory_usage().acceleration(), octree_budget);
+    }
+}
+
+void Mesh::build_octree() {
     // Update Octree bbox
     init_octree();
 
@@ -196,13 +231,37 @@ Mesh::Mesh(char *obj_file, float ior, float matte, float shiny, float scattering
     reduce_octree(&root);
 }
 
+MemoryStats Mesh::memory_usage() const {
+    MemoryStats stats;
+    stats.geometry = vertices.capacity() * sizeof(Vec3) + faces.capacity() * sizeof(Face) + colors.capacity() * sizeof(Vec3);
+    stats.normals = normals.capacity() * sizeof(Vec3);
+    stats.nodes = sizeof(OctreeNode);
+    root.memory_usage(&stats.nodes, &stats.leaf_indices);
+    for (const Mesh &lod : lods) {
+        stats += lod.memory_usage();
+    }
+    return stats;
+}
+
+void MemoryStats::operator+=(const MemoryStats &other) {
+    geometry += other.geometry;
+    normals += other.normals;
+    nodes += other.nodes;
+    leaf_indices += other.leaf_indices;
+}
+
+void MemoryStats::print(const char *name) const {
+    printf("%s: %.1f KB geometry, %.1f KB normals, %.1f KB octree nodes, %.1f KB leaf indices, %.1f KB total\n", name, geometry / 1024.0,
+           normals / 1024.0, nodes / 1024.0, leaf_indices / 1024.0, total() / 1024.0);
+}
+
 void Mesh::insert_face(int face_i) {
     Face face = faces[face_i];
     auto verts = {vertices[face.v0], vertices[face.v1], vertices[face.v2]};
     for (const Vec3 &vert : verts) {
         // Find host node
         OctreeNode *node = root.find(vert);
-        while (node->depth < OCTREE_MAXIMUM_DEPTH) {
+        while (node->depth < octree_max_depth) {
             node->explode();
             node = node->find(vert);
         }
@@ -210,11 +269,104 @@ void Mesh::insert_face(int face_i) {
     }
 }
 
-RaycastResult Mesh::raycast(const LightRay &ray) const {
+const Mesh &Mesh::level() const { return active_lod > 0 ? lods[active_lod - 1] : *this; }
+
+// Build a chain of simplified copies, halving the face count per level. The whole chain shares the
+// mesh's octree budget: each level may use what the finer ones left, and the chain stops at the first
+// level that does not fit.
+void Mesh::build_lods(int max_levels) {
+    lods.clear();
+    while ((int)lods.size() < max_levels) {
+        const Mesh &finer = lods.empty() ? *this : lods.back();
+        if (finer.faces.size() / 2 < LOD_MINIMUM_FACES) {
+            break;
+        }
+        size_t used = memory_usage().acceleration();
+        if (octree_budget > 0 && used >= octree_budget) {
+            fprintf(stderr, "No octree budget left for LOD %zu, stopping at %zu levels\n", lods.size() + 1, lods.size());
+            break;
+        }
+        vector<Vec3> lod_vertices;
+        vector<Face> lod_faces;
+        float error = simplify(finer.vertices, finer.faces, finer.faces.size() / 2, lod_vertices, lod_faces);
+        if (lod_faces.size() >= finer.faces.size() || lod_faces.empty()) {
+            break;
+        }
+        Mesh lod(lod_vertices, lod_faces, colors, ior, matte, shiny, octree_budget > 0 ? octree_budget - used : 0);
+        if (octree_budget > 0 && used + lod.memory_usage().acceleration() > octree_budget) {
+            fprintf(stderr, "LOD %zu does not fit the octree budget, stopping at %zu levels\n", lods.size() + 1, lods.size());
+            break;
+        }
+        lod.scattering = scattering;
+        lod.position = position;
+        lod.rotation = rotation;
+        lod.lod_error = finer.lod_error + error;
+        printf("LOD %zu has %zu faces, error %f\n", lods.size() + 1, lod.faces.size(), lod.lod_error);
+        lods.push_back(std::move(lod));
+    }
+}
+
+bool Mesh::write_obj(const char *obj_file) const {
+    FILE *f = fopen(obj_file, "w");
+    if (f == nullptr) {
+        fprintf(stderr, "Could not open file %s!\n", obj_file);
+        return false;
+    }
+    fprintf(f, "# lod_error %f\n", lod_error);
+    for (const Vec3 &v : vertices) {
+        fprintf(f, "v %f %f %f\n", v.x, v.y, v.z);
+    }
+    for (const Face &face : faces) {
+        fprintf(f, "f %d %d %d\n", face.v0 + 1, face.v1 + 1, face.v2 + 1);
+    }
+    return fclose(f) == 0;
+}
+
+// Tighten hit with this mesh's closest face, if it is strictly closer than what hit already holds.
+void Mesh::raycast(const LightRay &ray, int mesh_id, Hit &hit) const {
     LightRay transformed_ray = ray;
     transformed_ray.origin = ray.origin - position;
     transformed_ray.direction = ray.direction.rotate(-rotation);
-    return raycast(transformed_ray, &root);
+    const Mesh &mesh = level();
+    Hit closest;
+    closest.t = hit.t;
+    mesh.raycast(transformed_ray, &mesh.root, closest, false);
+    if (closest.hit()) {
+        hit = closest;
+        hit.mesh_id = mesh_id;
+    }
+}
+
+// Whether anything blocks the ray closer than tmax.
+bool Mesh::occluded(const LightRay &ray, float tmax) const {
+    LightRay transformed_ray = ray;
+    transformed_ray.origin = ray.origin - position;
+    transformed_ray.direction = ray.direction.rotate(-rotation);
+    const Mesh &mesh = level();
+    Hit hit;
+    hit.t = tmax;
+    mesh.raycast(transformed_ray, &mesh.root, hit, true);
+    return hit.hit();
+}
+
+// Shading attributes of a hit this mesh reported. The hit location is in mesh space, as traversal saw it.
+// Geometry comes from the active LOD, material terms from this mesh and are classified as they are now,
+// so they may be changed after construction.
+RaycastResult Mesh::resolve(const LightRay &ray, const Hit &hit) const {
+    const Mesh &mesh = level();
+    RaycastResult res;
+    res.hit = true;
+    res.mesh_id = hit.mesh_id;
+    res.dist = hit.t;
+    res.hit_location = (ray.origin - position) + ray.direction.rotate(-rotation) * hit.t;
+    res.ior = ior;
+    res.matte = matte;
+    res.scattering = scattering;
+    res.material = material_class(matte, shiny, scattering);
+    res.shiny = shiny;
+    res.color = mesh.colors[mesh.faces[hit.face_id].c];
+    res.normal = mesh.normals[hit.face_id];
+    return res;
 }
 
 bool LightRay::intersect(const BoundingBox &bbox) const {
@@ -231,39 +383,37 @@ bool LightRay::intersect(const BoundingBox &bbox) const {
     return bracket_max + EPS >= bracket_min;
 }
 
-RaycastResult Mesh::raycast(const LightRay &ray, const OctreeNode *node) const {
-    RaycastResult res;
+// Children fold into the same record, so the first strictly-closest face wins. With any_hit the
+// traversal stops at the first face it finds.
+void Mesh::raycast(const LightRay &ray, const OctreeNode *node, Hit &hit, bool any_hit) const {
     if (!ray.intersect(node->extent)) {
-        return res;
+        return;
     }
     if (!node->is_leaf()) {
         for (const OctreeNode &subnode : node->children) {
-            RaycastResult subres = raycast(ray, &subnode);
-            if ((!res.hit && subres.hit) || (subres.hit && res.hit && subres.dist < res.dist)) {
-                res = subres;
+            raycast(ray, &subnode, hit, any_hit);
+            if (any_hit && hit.hit()) {
+                return;
             }
         }
-        return res;
+        return;
     }
     for (int face_i : node->incident_faces) {
-        const Face &face = faces[face_i];
-        float dist = intersect(ray.origin, ray.direction, face);
-        if ((!res.hit && dist > 0) || (res.hit && dist > 0 && dist < res.dist)) {
-            res.hit = true;
-            res.dist = dist;
-            res.hit_location = ray.origin + ray.direction * dist;
-            res.ior = ior;
-            res.matte = matte;
-            res.scattering = scattering;
-            res.shiny = shiny;
-            res.color = colors[face.c];
-            res.normal = normals[face_i];
+        float u, v;
+        float dist = intersect(ray.origin, ray.direction, faces[face_i], u, v);
+        if (dist > 0 && dist < hit.t) {
+            hit.t = dist;
+            hit.face_id = face_i;
+            hit.u = u;
+            hit.v = v;
+            if (any_hit) {
+                return;
+            }
         }
     }
-    return res;
 }
 
-float Mesh::intersect(const Vec3 &origin, const Vec3 &ray, const Face &tri) const {
+float Mesh::intersect(const Vec3 &origin, const Vec3 &ray, const Face &tri, float &u, float &v) const {
     // return 1;
     // Extract vectors from tables
     const Vec3 &normal = normals[tri.normal];
@@ -295,14 +445,190 @@ float Mesh::intersect(const Vec3 &origin, const Vec3 &ray, const Face &tri) cons
     Vec3 BP = intersect - v1;
     Vec3 CP = intersect - v2;
     // Now check if intersection point is in the interior of the v1 crux angle
-    if (((A % AP) ^ normal) >= 0) {
+    float a = (A % AP) ^ normal;
+    if (a >= 0) {
         return -1;
     }
-    if (((B % BP) ^ normal) >= 0) {
+    float b = (B % BP) ^ normal;
+    if (b >= 0) {
         return -1;
     }
-    if (((C % CP) ^ normal) >= 0) {
+    float c = (C % CP) ^ normal;
+    if (c >= 0) {
         return -1;
     }
+    // Each edge test is proportional to the area of the sub-triangle opposite a vertex
+    float area = a + b + c;
+    u = c / area;
+    v = a / area;
     return t;
 }
+
+void RayPacket::push(const Vec3 &origin, const Vec3 &direction, bool is_active) {
+    ox[count] = origin.x;
+    oy[count] = origin.y;
+    oz[count] = origin.z;
+    dx[count] = direction.x;
+    dy[count] = direction.y;
+    dz[count] = direction.z;
+    active[count] = is_active;
+    count++;
+}
+
+bool RayPacket::coherent() const {
+    Vec3 mean;
+    for (int k = 0; k < count; k++) {
+        if (active[k]) {
+            mean = mean + Vec3(dx[k], dy[k], dz[k]);
+        }
+    }
+    if (mean.magnitude() < EPS) {
+        return false;
+    }
+    mean = mean.normalize();
+    for (int k = 0; k < count; k++) {
+        if (active[k] && (Vec3(dx[k], dy[k], dz[k]).normalize() ^ mean) < PACKET_COHERENCE) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Same slab test as LightRay::intersect, evaluated for every lane at once.
+void RayPacket::intersect(const BoundingBox &bbox, const bool *mask, bool *hits) const {
+    for (int k = 0; k < PACKET_RAYS; k++) {
+        float ax = (bbox.llb.x - ox[k]) / dx[k], bx = (bbox.urf.x - ox[k]) / dx[k];
+        float ay = (bbox.llb.y - oy[k]) / dy[k], by = (bbox.urf.y - oy[k]) / dy[k];
+        float az = (bbox.llb.z - oz[k]) / dz[k], bz = (bbox.urf.z - oz[k]) / dz[k];
+        float min_x = ax > bx ? bx : ax, max_x = ax > bx ? ax : bx;
+        float min_y = ay > by ? by : ay, max_y = ay > by ? ay : by;
+        float min_z = az > bz ? bz : az, max_z = az > bz ? az : bz;
+        float bracket_min = fmax(fmax(min_x, min_y), min_z);
+        float bracket_max = fmin(fmin(max_x, max_y), max_z);
+        hits[k] = mask[k] & (bracket_max + EPS >= bracket_min);
+    }
+}
+
+// Move the packet into mesh space and pad it to a full PACKET_RAYS lanes with inactive rays.
+RayPacket Mesh::to_local(const RayPacket &packet) const {
+    RayPacket local;
+    for (int k = 0; k < PACKET_RAYS; k++) {
+        bool in_packet = k < packet.count;
+        Vec3 origin = in_packet ? Vec3(packet.ox[k], packet.oy[k], packet.oz[k]) - position : Vec3();
+        Vec3 direction = in_packet ? Vec3(packet.dx[k], packet.dy[k], packet.dz[k]).rotate(-rotation) : Vec3(0, 0, 1);
+        local.push(origin, direction, in_packet && packet.active[k]);
+    }
+    return local;
+}
+
+// Per-lane closest hits of a packet traversal, laid out for the lane loops.
+struct PacketHits {
+    float t[PACKET_RAYS];
+    int face_id[PACKET_RAYS];
+    float u[PACKET_RAYS], v[PACKET_RAYS];
+};
+
+// Packet counterpart of the single-ray raycast: lanes of hits are tightened where this mesh has a
+// strictly closer face.
+void Mesh::raycast(const RayPacket &packet, int mesh_id, Hit *hits) const {
+    RayPacket local = to_local(packet);
+    PacketHits closest;
+    for (int k = 0; k < PACKET_RAYS; k++) {
+        closest.t[k] = k < packet.count ? hits[k].t : INFINITY;
+        closest.face_id[k] = -1;
+    }
+    const Mesh &mesh = level();
+    mesh.raycast(local, &mesh.root, local.active, closest, false);
+    for (int k = 0; k < packet.count; k++) {
+        if (closest.face_id[k] >= 0) {
+            hits[k].t = closest.t[k];
+            hits[k].mesh_id = mesh_id;
+            hits[k].face_id = closest.face_id[k];
+            hits[k].u = closest.u[k];
+            hits[k].v = closest.v[k];
+        }
+    }
+}
+
+// Per-lane occlusion, optionally bounded by a per-lane tmax.
+void Mesh::occluded(const RayPacket &packet, bool *occluded, const float *tmax) const {
+    RayPacket local = to_local(packet);
+    PacketHits closest;
+    for (int k = 0; k < PACKET_RAYS; k++) {
+        closest.t[k] = tmax != nullptr && k < packet.count ? tmax[k] : INFINITY;
+        closest.face_id[k] = -1;
+    }
+    const Mesh &mesh = level();
+    mesh.raycast(local, &mesh.root, local.active, closest, true);
+    for (int k = 0; k < packet.count; k++) {
+        occluded[k] = closest.face_id[k] >= 0;
+    }
+}
+
+// Packet counterpart of the single-ray traversal. Lanes are masked by their own box tests, so each lane
+// visits exactly the leaves its single ray would, and keeps the first strictly-closest face just like
+// the single-ray fold. With any_hit, lanes retire as soon as they hit anything.
+void Mesh::raycast(const RayPacket &packet, const OctreeNode *node, const bool *mask, PacketHits &hits, bool any_hit) const {
+    bool node_mask[PACKET_RAYS];
+    packet.intersect(node->extent, mask, node_mask);
+    bool any = false;
+    for (int k = 0; k < PACKET_RAYS; k++) {
+        if (any_hit && hits.face_id[k] >= 0) {
+            node_mask[k] = false;
+        }
+        any |= node_mask[k];
+    }
+    if (!any) {
+        return;
+    }
+    if (!node->is_leaf()) {
+        for (const OctreeNode &subnode : node->children) {
+            raycast(packet, &subnode, node_mask, hits, any_hit);
+        }
+        return;
+    }
+    float face_dists[PACKET_RAYS], face_us[PACKET_RAYS], face_vs[PACKET_RAYS];
+    for (int face_i : node->incident_faces) {
+        intersect(packet, node_mask, faces[face_i], face_dists, face_us, face_vs);
+        for (int k = 0; k < PACKET_RAYS; k++) {
+            if (face_dists[k] > 0 && face_dists[k] < hits.t[k]) {
+                hits.t[k] = face_dists[k];
+                hits.face_id[k] = face_i;
+                hits.u[k] = face_us[k];
+                hits.v[k] = face_vs[k];
+                node_mask[k] = node_mask[k] && !any_hit;
+            }
+        }
+    }
+}
+
+// Same test as the single-ray intersect, evaluated for every lane at once. Masked lanes report -1.
+void Mesh::intersect(const RayPacket &packet, const bool *mask, const Face &tri, float *dists, float *us, float *vs) const {
+    const Vec3 &normal = normals[tri.normal];
+    const Vec3 &v0 = vertices[tri.v0];
+    const Vec3 &v1 = vertices[tri.v1];
+    const Vec3 &v2 = vertices[tri.v2];
+    float D = -(v0 ^ normal);
+    Vec3 A = v1 - v0;
+    Vec3 B = v2 - v1;
+    Vec3 C = v0 - v2;
+    for (int k = 0; k < PACKET_RAYS; k++) {
+        float Ds = D + (normal.x * packet.ox[k] + normal.y * packet.oy[k] + normal.z * packet.oz[k]);
+        float F = normal.x * packet.dx[k] + normal.y * packet.dy[k] + normal.z * packet.dz[k];
+        float t = -Ds / F;
+        float px = packet.ox[k] + packet.dx[k] * t;
+        float py = packet.oy[k] + packet.dy[k] * t;
+        float pz = packet.oz[k] + packet.dz[k] * t;
+        float apx = px - v0.x, apy = py - v0.y, apz = pz - v0.z;
+        float bpx = px - v1.x, bpy = py - v1.y, bpz = pz - v1.z;
+        float cpx = px - v2.x, cpy = py - v2.y, cpz = pz - v2.z;
+        float a = (A.y * apz - A.z * apy) * normal.x + (A.z * apx - A.x * apz) * normal.y + (A.x * apy - A.y * apx) * normal.z;
+        float b = (B.y * bpz - B.z * bpy) * normal.x + (B.z * bpx - B.x * bpz) * normal.y + (B.x * bpy - B.y * bpx) * normal.z;
+        float c = (C.y * cpz - C.z * cpy) * normal.x + (C.z * cpx - C.x * cpz) * normal.y + (C.x * cpy - C.y * cpx) * normal.z;
+        bool inside = mask[k] & (fabs(F) >= EPS) & (t >= EPS) & (a < 0) & (b < 0) & (c < 0);
+        dists[k] = inside ? t : -1;
+        float area = a + b + c;
+        us[k] = c / area;
+        vs[k] = a / area;
+    }
+}
@@ -17,10 +17,23 @@
 
 using std::vector, std::sort, std::find, std::set, std::swap;
 
+// LOD chains stop once a level would have fewer faces than this
+const int LOD_MINIMUM_FACES = 64;
+
 struct LightRay;
+struct RayPacket;
+struct PacketHits;
+
+// Material classes are bit sets of the lighting terms a material can contribute
+const int MATERIAL_DIFFUSE = 1;    // matte > 0: direct illumination with shadow rays
+const int MATERIAL_REFLECTIVE = 2; // shiny > 0: Fresnel-weighted reflection ray
+const int MATERIAL_REFRACTIVE = 4; // scattering > 0: Fresnel-weighted refraction ray
+
+int material_class(float matte, float shiny, float scattering);
 
 struct RaycastResult {
     bool hit = false;
+    int mesh_id = -1;
     Vec3 hit_location;
     Vec3 normal;
     Vec3 color;
@@ -29,6 +42,16 @@ struct RaycastResult {
     float matte = 0.2;
     float shiny =  1;
     float scattering = 0;
+    int material = MATERIAL_DIFFUSE | MATERIAL_REFLECTIVE;
+};
+
+// Closest hit as carried through traversal. Shading attributes are looked up once, by Mesh::resolve.
+struct Hit {
+    float t = INFINITY;
+    int mesh_id = -1;
+    int face_id = -1;
+    float u = 0, v = 0; // Barycentric weights of the face's v1 and v2
+    bool hit() const { return face_id >= 0; }
 };
 
 struct Face {
@@ -43,6 +66,17 @@ struct Face {
     int c;
 };
 
+struct MemoryStats {
+    size_t geometry = 0;     // Vertices, faces and colors
+    size_t normals = 0;
+    size_t nodes = 0;        // Octree nodes
+    size_t leaf_indices = 0; // Face indices held by octree leaves
+    size_t acceleration() const { return nodes + leaf_indices; }
+    size_t total() const { return geometry + normals + nodes + leaf_indices; }
+    void operator+=(const MemoryStats &other);
+    void print(const char *name) const;
+};
+
 struct Mesh {
     Vec3 position, rotation;
     vector<Vec3> vertices, colors, normals;
@@ -53,13 +87,37 @@ struct Mesh {
     float scattering = 0;
 
     OctreeNode root;
+    int octree_max_depth = OCTREE_MAXIMUM_DEPTH;
+    int octree_min_faces = OCTREE_MINIMUM_FACES;
+    size_t octree_budget = 0; // Bytes the octree may use, 0 for unlimited
+
+    vector<Mesh> lods;   // Progressively coarser copies, each with its own octree
+    float lod_error = 0; // Upper bound on how far this level's surface is from the full-resolution mesh
+    mutable int active_lod = 0; // 0 traces this mesh, n traces lods[n - 1]; picked per render by select_lods
 
     Mesh(char *obj_file, float ior, float matte, float shiny, float scattering);
-    Mesh(vector<Vec3> vertices, vector<Face> faces, vector<Vec3> colors, float ior, float diffusion, float smoothness);
-    RaycastResult raycast(const LightRay &ray) const;
-    RaycastResult raycast(const LightRay &ray, const OctreeNode *node) const;
-    float intersect(const Vec3 &origin, const Vec3 &direction, const Face &face) const;
+    Mesh(char *obj_file, float ior, float matte, float shiny, float scattering, size_t octree_budget);
+    Mesh(vector<Vec3> vertices, vector<Face> faces, vector<Vec3> colors, float ior, float diffusion, float smoothness,
+         size_t octree_budget = 0);
+    void raycast(const LightRay &ray, int mesh_id, Hit &hit) const;
+    bool occluded(const LightRay &ray, float tmax = INFINITY) const;
+    RaycastResult resolve(const LightRay &ray, const Hit &hit) const;
+    void raycast(const LightRay &ray, const OctreeNode *node, Hit &hit, bool any_hit) const;
+    float intersect(const Vec3 &origin, const Vec3 &direction, const Face &face, float &u, float &v) const;
+    RayPacket to_local(const RayPacket &packet) const;
+    void raycast(const RayPacket &packet, int mesh_id, Hit *hits) const;
+    void occluded(const RayPacket &packet, bool *occluded, const float *tmax = nullptr) const;
+    void raycast(const RayPacket &packet, const OctreeNode *node, const bool *mask, PacketHits &hits, bool any_hit) const;
+    void intersect(const RayPacket &packet, const bool *mask, const Face &face, float *dists, float *us, float *vs) const;
+
+    const Mesh &level() const;
+    void build_lods(int max_levels);
+    bool write_obj(const char *obj_file) const;
+
+    MemoryStats memory_usage() const;
 
+    void build();
+    void build_octree();
     void init_octree();
     bool reduce_octree(OctreeNode *node);
     void read_file(char *obj_file);
@@ -51,7 +51,8 @@ void OctreeNode::contract() {
         children[i].contract();
         incident_faces.insert(children[i].incident_faces.begin(), children[i].incident_faces.end());
     }
-    children.clear();
+    // Release the child array rather than keeping its capacity around
+    vector<OctreeNode>().swap(children);
 }
 void OctreeNode::count_faces() {
     if (is_leaf()) {
@@ -67,6 +68,15 @@ void OctreeNode::count_faces() {
 
 }
 
+// Accumulate the heap memory below this node: child node arrays, and face indices held by leaves.
+void OctreeNode::memory_usage(size_t *node_bytes, size_t *leaf_indices) const {
+    *node_bytes += children.capacity() * sizeof(OctreeNode);
+    *leaf_indices += incident_faces.size() * SET_NODE_BYTES;
+    for (const OctreeNode &child : children) {
+        child.memory_usage(node_bytes, leaf_indices);
+    }
+}
+
 OctreeNode *OctreeNode::find(const Vec3 &point) {
     if (is_leaf()) {
         return extent.contains(point) ? this : nullptr;
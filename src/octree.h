@@ -18,6 +18,10 @@ using std::vector, std::sort, std::find, std::set;
 const int OCTREE_MINIMUM_FACES = 256;
 const int OCTREE_MAXIMUM_DEPTH = 20;
 
+// Estimated heap footprint of one std::set<int> element. A libstdc++ red-black node (color, three links,
+// key) pads to 40 bytes, and malloc adds a size word and rounds chunks up to 16.
+const size_t SET_NODE_BYTES = 48;
+
 struct BoundingBox {
     Vec3 llb, urf;
     BoundingBox(const Vec3& llb, const Vec3& urf) {
@@ -44,6 +48,7 @@ struct OctreeNode {
     void explode();
     void contract();
     void count_faces();
+    void memory_usage(size_t *node_bytes, size_t *leaf_indices) const;
     OctreeNode *find(const Vec3 &point);
 };
 
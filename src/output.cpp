@@ -0,0 +1,363 @@
+#include "output.h"
+#include "canvas.hpp"
+#include <algorithm>
+#include <strings.h>
+#include <thread>
+#include <zlib.h>
+
+using std::thread;
+
+int pixel_size(int format) {
+    switch (format) {
+    case IMAGE_PFM:
+        return 3 * sizeof(float);
+    case IMAGE_RGBE:
+        return 4;
+    default:
+        return 3;
+    }
+}
+
+// Scratch size for coalescing pixels when the file could not be mapped
+const int IMAGE_RUN_BYTES = 4096;
+
+// Clamped, since out-of-range floats do not convert to unsigned char
+unsigned char quantize(float v) { return fmin(fmax(v, 0.0f), 1.0f) * 255; }
+
+void encode_pixel(int format, const Vec3 &rgb, unsigned char *dst) {
+    switch (format) {
+    case IMAGE_PFM: {
+        float rgbf[3] = {rgb.x, rgb.y, rgb.z};
+        memcpy(dst, rgbf, sizeof(rgbf));
+        break;
+    }
+    case IMAGE_RGBE: {
+        float v = fmax(fmax(rgb.x, rgb.y), rgb.z);
+        if (v < 1e-32) {
+            dst[0] = dst[1] = dst[2] = dst[3] = 0;
+            break;
+        }
+        int e;
+        float scale = frexp(v, &e) * 256.0f / v;
+        dst[0] = rgb.x * scale;
+        dst[1] = rgb.y * scale;
+        dst[2] = rgb.z * scale;
+        dst[3] = e + 128;
+        break;
+    }
+    default: {
+        dst[0] = quantize(rgb.x);
+        dst[1] = quantize(rgb.y);
+        dst[2] = quantize(rgb.z);
+    }
+    }
+}
+
+// Write the whole buffer, retrying short writes.
+bool write_all(int fd, const void *data, size_t length, off_t offset) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    while (length > 0) {
+        ssize_t written = pwrite(fd, bytes, length, offset);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        bytes += written;
+        length -= written;
+        offset += written;
+    }
+    return true;
+}
+
+// Run fn(row) for every row, with rows interleaved across the hardware threads.
+template <typename F> void parallel_rows(int height, F fn) {
+    int n_workers = thread::hardware_concurrency();
+    vector<thread> workers;
+    for (int w = 0; w < n_workers; w++) {
+        workers.push_back(thread([=] {
+            for (int i = w; i < height; i += n_workers) {
+                fn(i);
+            }
+        }));
+    }
+    for (thread &worker : workers) {
+        worker.join();
+    }
+}
+
+ImageStream::~ImageStream() { close(); }
+
+bool ImageStream::open(const char *path, int format, int width, int height) {
+    if (format == IMAGE_PNG) {
+        fprintf(stderr, "PNG output cannot be streamed, use write_image for %s!\n", path);
+        return false;
+    }
+    // Reopening finishes the previous image first
+    close();
+    this->format = format;
+    this->width = width;
+    this->height = height;
+
+    char header[64];
+    switch (format) {
+    case IMAGE_PFM:
+        // Negative scale marks little-endian floats
+        header_size = snprintf(header, sizeof(header), "PF\n%d %d\n-1.0\n", width, height);
+        break;
+    case IMAGE_RGBE:
+        header_size = snprintf(header, sizeof(header), "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y %d +X %d\n", height, width);
+        break;
+    default:
+        header_size = snprintf(header, sizeof(header), "P6 %d %d 255\n", width, height);
+    }
+    length = header_size + (size_t)width * height * pixel_size(format);
+
+    fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd == -1) {
+        fprintf(stderr, "Could not open file %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    if (ftruncate(fd, length) == -1 || !write_all(fd, header, header_size, 0)) {
+        fprintf(stderr, "Could not size file %s: %s\n", path, strerror(errno));
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+    map = (unsigned char *)mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        map = nullptr;
+    }
+    failed = false;
+    error = 0;
+    return true;
+}
+
+void ImageStream::write_tile(const Canvas &canvas, const vector<int> &tile) {
+    // Offsets come from the stream's size, so a different canvas would write outside the file
+    if (canvas.width != width || canvas.height != height) {
+        fail(EINVAL);
+        return;
+    }
+    int psize = pixel_size(format);
+    unsigned char run[IMAGE_RUN_BYTES];
+    size_t run_bytes = 0;
+    off_t run_offset = 0;
+    // Tiles come in Morton order; raster order lets the pwrite fallback coalesce whole tile rows
+    vector<int> pixels;
+    if (map == nullptr) {
+        pixels = tile;
+        std::sort(pixels.begin(), pixels.end());
+    }
+    const vector<int> &order = map == nullptr ? pixels : tile;
+    for (size_t k = 0; k < order.size(); k++) {
+        int i = order[k] / canvas.width;
+        int j = order[k] % canvas.width;
+        // PFM stores scanlines bottom to top
+        int row = format == IMAGE_PFM ? height - 1 - i : i;
+        off_t offset = header_size + ((off_t)row * width + j) * psize;
+        if (map != nullptr) {
+            encode_pixel(format, canvas[i][j], map + offset);
+            continue;
+        }
+        // Without a mapping, coalesce horizontally adjacent pixels into one pwrite
+        if (run_bytes > 0 && (offset != run_offset + (off_t)run_bytes || run_bytes + psize > sizeof(run))) {
+            write_run(run, run_bytes, run_offset);
+            run_bytes = 0;
+        }
+        if (run_bytes == 0) {
+            run_offset = offset;
+        }
+        encode_pixel(format, canvas[i][j], run + run_bytes);
+        run_bytes += psize;
+    }
+    if (run_bytes > 0) {
+        write_run(run, run_bytes, run_offset);
+    }
+}
+
+// Write one run unless an earlier write failed, remembering the errno of the first failure.
+void ImageStream::write_run(const unsigned char *run, size_t run_bytes, off_t run_offset) {
+    if (!failed && !write_all(fd, run, run_bytes, run_offset)) {
+        fail(errno);
+    }
+}
+
+void ImageStream::fail(int error) {
+    int none = 0;
+    this->error.compare_exchange_strong(none, error);
+    failed = true;
+}
+
+void ImageStream::write_rows(const Canvas &canvas, int row_begin, int row_end) {
+    vector<int> row;
+    for (int i = row_begin; i < row_end; i++) {
+        row.clear();
+        for (int j = 0; j < width; j++) {
+            row.push_back(i * width + j);
+        }
+        write_tile(canvas, row);
+    }
+}
+
+bool ImageStream::close() {
+    if (fd == -1) {
+        return !failed;
+    }
+    if (map != nullptr) {
+        munmap(map, length);
+        map = nullptr;
+    }
+    if (::close(fd) == -1) {
+        fail(errno);
+    }
+    fd = -1;
+    if (failed) {
+        fprintf(stderr, "Failed writing %zu byte image: %s\n", length, strerror(error));
+    }
+    return !failed;
+}
+
+void png_chunk(vector<unsigned char> &out, const char *type, const unsigned char *data, size_t length) {
+    unsigned char be[4] = {(unsigned char)(length >> 24), (unsigned char)(length >> 16), (unsigned char)(length >> 8), (unsigned char)length};
+    out.insert(out.end(), be, be + 4);
+    size_t type_at = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data, data + length);
+    uLong crc = crc32(0, out.data() + type_at, length + 4);
+    unsigned char crc_be[4] = {(unsigned char)(crc >> 24), (unsigned char)(crc >> 16), (unsigned char)(crc >> 8), (unsigned char)crc};
+    out.insert(out.end(), crc_be, crc_be + 4);
+}
+
+int paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    return pb <= pc ? b : c;
+}
+
+// Quantize and filter one scanline, picking the filter type with the smallest sum of absolute residuals.
+void png_filter_row(const Canvas &canvas, int i, unsigned char *dst) {
+    int stride = canvas.width * 3;
+    vector<unsigned char> cur(stride), up(stride, 0), trial(stride);
+    for (int j = 0; j < canvas.width; j++) {
+        encode_pixel(IMAGE_PNG, canvas[i][j], &cur[j * 3]);
+        if (i > 0) {
+            encode_pixel(IMAGE_PNG, canvas[i - 1][j], &up[j * 3]);
+        }
+    }
+    long best_cost = -1;
+    for (unsigned char filter = 0; filter < 5; filter++) {
+        long cost = 0;
+        for (int k = 0; k < stride; k++) {
+            int a = k >= 3 ? cur[k - 3] : 0;
+            int b = up[k];
+            int c = k >= 3 ? up[k - 3] : 0;
+            int predicted[5] = {0, a, b, (a + b) / 2, paeth(a, b, c)};
+            trial[k] = cur[k] - predicted[filter];
+            cost += abs((signed char)trial[k]);
+        }
+        if (best_cost < 0 || cost < best_cost) {
+            best_cost = cost;
+            dst[0] = filter;
+            memcpy(dst + 1, trial.data(), stride);
+        }
+    }
+}
+
+bool write_png(const Canvas &canvas, const char *path) {
+    size_t row_bytes = 1 + canvas.width * 3;
+    size_t raw_length = row_bytes * canvas.height;
+    vector<unsigned char> filtered(raw_length);
+    parallel_rows(canvas.height, [&](int i) { png_filter_row(canvas, i, &filtered[i * row_bytes]); });
+
+    // Deflate independent segments in parallel. Every segment but the last ends on a byte-aligned sync
+    // flush, so the raw streams concatenate into one valid deflate stream.
+    int n_segments = (raw_length + PNG_SEGMENT_BYTES - 1) / PNG_SEGMENT_BYTES;
+    vector<vector<unsigned char>> segments(n_segments);
+    vector<uLong> adlers(n_segments);
+    atomic<bool> failed{false};
+    parallel_rows(n_segments, [&](int s) {
+        size_t begin = (size_t)s * PNG_SEGMENT_BYTES;
+        size_t length = std::min((size_t)PNG_SEGMENT_BYTES, raw_length - begin);
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(&zs, Z_BEST_SPEED, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            failed = true;
+            return;
+        }
+        segments[s].resize(deflateBound(&zs, length) + 16);
+        zs.next_in = &filtered[begin];
+        zs.avail_in = length;
+        zs.next_out = segments[s].data();
+        zs.avail_out = segments[s].size();
+        bool last = s == n_segments - 1;
+        int status = deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+        if (status != (last ? Z_STREAM_END : Z_OK) || zs.avail_in != 0) {
+            failed = true;
+        }
+        segments[s].resize(zs.total_out);
+        deflateEnd(&zs);
+        adlers[s] = adler32(adler32(0, nullptr, 0), &filtered[begin], length);
+    });
+    if (failed) {
+        fprintf(stderr, "Could not compress %s!\n", path);
+        return false;
+    }
+
+    vector<unsigned char> out = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    unsigned char ihdr[13] = {(unsigned char)(canvas.width >> 24), (unsigned char)(canvas.width >> 16), (unsigned char)(canvas.width >> 8),
+                              (unsigned char)canvas.width, (unsigned char)(canvas.height >> 24), (unsigned char)(canvas.height >> 16),
+                              (unsigned char)(canvas.height >> 8), (unsigned char)canvas.height, 8, 2, 0, 0, 0};
+    png_chunk(out, "IHDR", ihdr, sizeof(ihdr));
+    uLong adler = adlers[0];
+    for (int s = 1; s < n_segments; s++) {
+        adler = adler32_combine(adler, adlers[s], std::min((size_t)PNG_SEGMENT_BYTES, raw_length - (size_t)s * PNG_SEGMENT_BYTES));
+    }
+    unsigned char zlib_header[2] = {0x78, 0x01};
+    unsigned char zlib_trailer[4] = {(unsigned char)(adler >> 24), (unsigned char)(adler >> 16), (unsigned char)(adler >> 8), (unsigned char)adler};
+    png_chunk(out, "IDAT", zlib_header, sizeof(zlib_header));
+    for (const vector<unsigned char> &segment : segments) {
+        png_chunk(out, "IDAT", segment.data(), segment.size());
+    }
+    png_chunk(out, "IDAT", zlib_trailer, sizeof(zlib_trailer));
+    png_chunk(out, "IEND", nullptr, 0);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd == -1) {
+        fprintf(stderr, "Could not open file %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    bool ok = write_all(fd, out.data(), out.size(), 0);
+    ok = close(fd) == 0 && ok;
+    if (!ok) {
+        fprintf(stderr, "Failed writing %s: %s\n", path, strerror(errno));
+    }
+    return ok;
+}
+
+int image_format(const char *path) {
+    const char *ext = strrchr(path, '.');
+    if (ext == nullptr) {
+        return IMAGE_PPM;
+    }
+    if (strcasecmp(ext, ".pfm") == 0) return IMAGE_PFM;
+    if (strcasecmp(ext, ".hdr") == 0 || strcasecmp(ext, ".rgbe") == 0) return IMAGE_RGBE;
+    if (strcasecmp(ext, ".png") == 0) return IMAGE_PNG;
+    return IMAGE_PPM;
+}
+
+bool write_image(const Canvas &canvas, const char *path, int format) {
+    if (format == IMAGE_PNG) {
+        return write_png(canvas, path);
+    }
+    ImageStream stream;
+    if (!stream.open(path, format, canvas.width, canvas.height)) {
+        return false;
+    }
+    parallel_rows(canvas.height, [&](int i) { stream.write_rows(canvas, i, i + 1); });
+    return stream.close();
+}
+
+bool write_image(const Canvas &canvas, const char *path) { return write_image(canvas, path, image_format(path)); }
@@ -0,0 +1,48 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <atomic>
+#include <stddef.h>
+#include <sys/types.h>
+#include <vector>
+
+using std::vector, std::atomic;
+
+struct Canvas;
+
+const int IMAGE_PPM = 0;  // 8-bit binary RGB, expects exposed pixels
+const int IMAGE_PFM = 1;  // 32-bit float RGB, pre-exposure radiance
+const int IMAGE_RGBE = 2; // Radiance shared-exponent RGBE, pre-exposure radiance
+const int IMAGE_PNG = 3;  // 8-bit RGB, expects exposed pixels, deflate-compressed
+
+// Filtered scanline bytes handed to each deflate worker
+const int PNG_SEGMENT_BYTES = 1 << 18;
+
+// A fixed-size image file whose pixels can be written in any order, e.g. tile by tile as a render
+// progresses. The file is mmap'd when possible and falls back to pwrite otherwise. PNG is variable
+// length and cannot be streamed.
+struct ImageStream {
+    int format = IMAGE_PFM;
+    int width = 0, height = 0;
+    int fd = -1;
+    unsigned char *map = nullptr;
+    size_t header_size = 0, length = 0;
+    atomic<bool> failed{false};
+    atomic<int> error{0}; // errno of the first failure
+
+    ImageStream(){};
+    ImageStream(const ImageStream &) = delete;
+    ~ImageStream();
+    bool open(const char *path, int format, int width, int height);
+    void write_tile(const Canvas &canvas, const vector<int> &tile);
+    void write_rows(const Canvas &canvas, int row_begin, int row_end);
+    bool close();
+    void write_run(const unsigned char *run, size_t run_bytes, off_t run_offset);
+    void fail(int error);
+};
+
+int image_format(const char *path);
+bool write_image(const Canvas &canvas, const char *path, int format);
+bool write_image(const Canvas &canvas, const char *path);
+
+#endif
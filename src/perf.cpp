@@ -0,0 +1,51 @@
+#include "perf.h"
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+void CacheStats::operator+=(const CacheStats &other) {
+    references += other.references;
+    misses += other.misses;
+    available &= other.available;
+}
+
+void CacheStats::print(const char *name) const {
+    if (!available) {
+        printf("%s: cache counters unavailable\n", name);
+        return;
+    }
+    printf("%s: %lld LLC references, %lld LLC misses (%.2f%% miss rate)\n", name, references, misses,
+           references > 0 ? 100.0 * misses / references : 0.0);
+}
+
+int open_counter(unsigned long long config) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+CacheCounters::CacheCounters() {
+    references_fd = open_counter(PERF_COUNT_HW_CACHE_REFERENCES);
+    misses_fd = open_counter(PERF_COUNT_HW_CACHE_MISSES);
+}
+
+CacheCounters::~CacheCounters() {
+    if (references_fd >= 0) close(references_fd);
+    if (misses_fd >= 0) close(misses_fd);
+}
+
+CacheStats CacheCounters::read() const {
+    CacheStats stats;
+    if (references_fd < 0 || misses_fd < 0 || ::read(references_fd, &stats.references, sizeof(long long)) != sizeof(long long) ||
+        ::read(misses_fd, &stats.misses, sizeof(long long)) != sizeof(long long)) {
+        return CacheStats{0, 0, false};
+    }
+    return stats;
+}
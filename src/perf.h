@@ -0,0 +1,24 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdio.h>
+
+// Last-level cache traffic: references are mostly L2 misses, misses go out to memory.
+struct CacheStats {
+    long long references = 0, misses = 0;
+    bool available = true;
+    void operator+=(const CacheStats &other);
+    void print(const char *name) const;
+};
+
+// Hardware cache counters of the calling thread, from perf_event_open. Containers, VMs and restrictive
+// perf_event_paranoid settings often hide them, in which case the stats read as unavailable.
+struct CacheCounters {
+    int references_fd = -1, misses_fd = -1;
+    CacheCounters();
+    CacheCounters(const CacheCounters &) = delete;
+    ~CacheCounters();
+    CacheStats read() const;
+};
+
+#endif
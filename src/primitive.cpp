@@ -1,17 +1,5 @@
 #include "primitive.h"
 
-Vec3::Vec3(const Vec3 &other) {
-    x = other.x;
-    y = other.y;
-    z = other.z;
-}
-
-void Vec3::operator=(const Vec3 &other) {
-    x = other.x;
-    y = other.y;
-    z = other.z;
-}
-
 bool Vec3::operator==(const Vec3 &other) { return x == other.x && y == other.y && z == other.z; }
 
 // Invert the vector
@@ -85,6 +73,14 @@ Vec3 Vec3::rotate(const Vec3 &rpy) const {
     return vec;
 }
 
+// Inverse of rotate(rpy): the axis rotations undone in reverse order.
+Vec3 Vec3::unrotate(const Vec3 &rpy) const {
+    Vec3 vec = rotate(2, -rpy.z);
+    vec = vec.rotate(1, -rpy.y);
+    vec = vec.rotate(0, -rpy.x);
+    return vec;
+}
+
 unsigned char Vec3::compare(const Vec3& other) const{
     unsigned char bitcode = 0;
     bitcode |= x > other.x;
@@ -17,14 +17,14 @@ struct Vec3 {
   public:
     float x, y, z;
 
-    Vec3(const Vec3 &other);
+    Vec3(const Vec3 &other) = default;
     Vec3(float x = 0, float y = 0, float z = 0) : x(x), y(y), z(z){};
 
     // No vector operators
     Vec3 operator-() const;
 
     // Single-vector operators
-    void operator=(const Vec3 &other);
+    Vec3 &operator=(const Vec3 &other) = default;
     bool operator==(const Vec3 &other);
 
     // Two-vector operations.
@@ -42,6 +42,7 @@ struct Vec3 {
     float dot(const Vec3 &v) const;
     Vec3 rotate(int axis, float radians_cw) const;
     Vec3 rotate(const Vec3 &rpy) const;
+    Vec3 unrotate(const Vec3 &rpy) const;
     unsigned char compare(const Vec3& other) const;
 };
 
@@ -0,0 +1,140 @@
+#include "query.h"
+
+// Queries carry no color, so built meshes share a single white one.
+int build_mesh(QueryScene &query_scene, vector<Vec3> vertices, vector<Face> faces) {
+    for (Face &face : faces) {
+        face.c = 0;
+    }
+    int mesh_id = query_scene.scene.meshes.size() + query_scene.pending.size();
+    query_scene.pending.push_back(query_scene.pool.submit([vertices = std::move(vertices), faces = std::move(faces)] {
+        return Mesh(vertices, faces, {Vec3(1, 1, 1)}, 1, 0.2, 1);
+    }));
+    query_scene.committed = false;
+    return mesh_id;
+}
+
+void load_meshes(QueryScene &query_scene, const vector<MeshSource> &sources) {
+    for (future<Mesh> &mesh : load_meshes_async(query_scene.pool, sources)) {
+        query_scene.pending.push_back(std::move(mesh));
+    }
+    query_scene.committed = false;
+}
+
+// Wait for pending builds and pin every mesh to full detail, so queries are exact.
+void commit_scene(QueryScene &query_scene) {
+    wait_meshes(query_scene.scene, query_scene.pending);
+    for (Mesh &mesh : query_scene.scene.meshes) {
+        mesh.active_lod = 0;
+    }
+    query_scene.committed = true;
+}
+
+LightRay light_ray(const Ray &ray) {
+    LightRay light_ray;
+    light_ray.origin = ray.origin;
+    light_ray.direction = ray.direction;
+    return light_ray;
+}
+
+// Gather up to PACKET_RAYS rays from rays[start] on, returning how many were taken.
+int gather_packet(const Ray *rays, size_t start, size_t end, RayPacket &packet, float *tmax) {
+    int count = end - start < (size_t)PACKET_RAYS ? end - start : PACKET_RAYS;
+    for (int k = 0; k < count; k++) {
+        packet.push(rays[start + k].origin, rays[start + k].direction, true);
+        tmax[k] = rays[start + k].tmax;
+    }
+    return count;
+}
+
+// Rays are traced PACKET_RAYS at a time, as packets when they are coherent and one by one otherwise.
+void intersect_batch(const Scene &scene, const Ray *rays, Hit *hits, size_t start, size_t end) {
+    for (; start < end; start += PACKET_RAYS) {
+        RayPacket packet;
+        float tmax[PACKET_RAYS];
+        int count = gather_packet(rays, start, end, packet, tmax);
+        for (int k = 0; k < count; k++) {
+            hits[start + k] = Hit();
+            hits[start + k].t = tmax[k];
+        }
+        bool coherent = count > 1 && packet.coherent();
+        for (size_t mesh_id = 0; mesh_id < scene.meshes.size(); mesh_id++) {
+            const Mesh &mesh = scene.meshes[mesh_id];
+            if (coherent) {
+                mesh.raycast(packet, mesh_id, hits + start);
+                continue;
+            }
+            for (int k = 0; k < count; k++) {
+                mesh.raycast(light_ray(rays[start + k]), mesh_id, hits[start + k]);
+            }
+        }
+        for (int k = 0; k < count; k++) {
+            if (!hits[start + k].hit()) {
+                hits[start + k] = Hit();
+            }
+        }
+    }
+}
+
+// Lanes retire from later meshes once any mesh blocks them.
+void occluded_batch(const Scene &scene, const Ray *rays, bool *occluded, size_t start, size_t end) {
+    for (; start < end; start += PACKET_RAYS) {
+        RayPacket packet;
+        float tmax[PACKET_RAYS];
+        int count = gather_packet(rays, start, end, packet, tmax);
+        std::fill(occluded + start, occluded + start + count, false);
+        bool coherent = count > 1 && packet.coherent();
+        for (const Mesh &mesh : scene.meshes) {
+            if (coherent) {
+                bool blocked[PACKET_RAYS];
+                mesh.occluded(packet, blocked, tmax);
+                for (int k = 0; k < count; k++) {
+                    occluded[start + k] = occluded[start + k] || blocked[k];
+                    packet.active[k] = !occluded[start + k];
+                }
+                continue;
+            }
+            for (int k = 0; k < count; k++) {
+                if (!occluded[start + k]) {
+                    occluded[start + k] = mesh.occluded(light_ray(rays[start + k]), tmax[k]);
+                }
+            }
+        }
+    }
+}
+
+// Split [0, count) into QUERY_BATCH_RAYS sized tasks on the pool and wait for all of them.
+template <typename F> void parallel_batches(ThreadPool &pool, size_t count, F trace_batch) {
+    if (count <= (size_t)QUERY_BATCH_RAYS || pool.size() <= 1) {
+        trace_batch(0, count);
+        return;
+    }
+    vector<future<void>> batches;
+    for (size_t start = 0; start < count; start += QUERY_BATCH_RAYS) {
+        size_t end = count - start < (size_t)QUERY_BATCH_RAYS ? count : start + QUERY_BATCH_RAYS;
+        batches.push_back(pool.submit([trace_batch, start, end] { trace_batch(start, end); }));
+    }
+    for (future<void> &batch : batches) {
+        batch.get();
+    }
+}
+
+bool intersect(QueryScene &query_scene, const Ray *rays, Hit *hits, size_t count) {
+    if (!query_scene.committed) {
+        fprintf(stderr, "Query scene has uncommitted meshes!\n");
+        return false;
+    }
+    const Scene &scene = query_scene.scene;
+    parallel_batches(query_scene.pool, count, [&scene, rays, hits](size_t start, size_t end) { intersect_batch(scene, rays, hits, start, end); });
+    return true;
+}
+
+bool occluded(QueryScene &query_scene, const Ray *rays, bool *occluded, size_t count) {
+    if (!query_scene.committed) {
+        fprintf(stderr, "Query scene has uncommitted meshes!\n");
+        return false;
+    }
+    const Scene &scene = query_scene.scene;
+    parallel_batches(query_scene.pool, count,
+                     [&scene, rays, occluded](size_t start, size_t end) { occluded_batch(scene, rays, occluded, start, end); });
+    return true;
+}
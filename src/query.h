@@ -0,0 +1,35 @@
+#ifndef QUERY_H
+#define QUERY_H
+
+#include "loader.h"
+
+// Rays handed to each pool task. Calls with fewer rays run on the calling thread.
+const int QUERY_BATCH_RAYS = 4096;
+
+// Ray for geometric queries. Hits at or beyond tmax are ignored, so a segment of length L is the ray
+// from one end with tmax = L, in units of the direction's length.
+struct Ray {
+    Vec3 origin, direction;
+    float tmax = INFINITY;
+};
+
+// Geometry for batched visibility queries, with its own worker pool. Meshes are added with build_mesh or
+// load_meshes, built in the background, and frozen by commit_scene before queries can run.
+struct QueryScene {
+    Scene scene;
+    ThreadPool pool;
+    vector<future<Mesh>> pending;
+    bool committed = false;
+    QueryScene(int threads = 0) : pool(threads){};
+};
+
+int build_mesh(QueryScene &query_scene, vector<Vec3> vertices, vector<Face> faces);
+void load_meshes(QueryScene &query_scene, const vector<MeshSource> &sources);
+void commit_scene(QueryScene &query_scene);
+
+// Closest hit per ray, misses have face_id -1. Must not be called from a task on query_scene.pool.
+bool intersect(QueryScene &query_scene, const Ray *rays, Hit *hits, size_t count);
+// Whether each ray hits anything before its tmax. Must not be called from a task on query_scene.pool.
+bool occluded(QueryScene &query_scene, const Ray *rays, bool *occluded, size_t count);
+
+#endif
@@ -1,4 +1,7 @@
 #include "render.h"
+#include "irradiance.h"
+#include "perf.h"
+#include "shadow.h"
 
 void Camera::expose(Canvas &canvas) const {
     Vec3 max_exposure = Vec3(max_exposure_energy, max_exposure_energy, max_exposure_energy);
@@ -42,6 +45,63 @@ LightRay Camera::get_initial_ray(const Canvas &canvas, int ray_id) const {
     return ray;
 }
 
+// Inverse of get_initial_ray: the fractional pixel whose ray passes through point. False if the point
+// is behind the camera.
+bool Camera::project(const Canvas &canvas, const Vec3 &point, float &i, float &j) const {
+    Vec3 direction = (point - loc).unrotate(rotation);
+    if (direction.z < EPS) {
+        return false;
+    }
+    int fold_i = canvas.height / 2.0;
+    int fold_j = canvas.width / 2.0;
+    float scaled_x = direction.x / direction.z * focal_plane_distance;
+    float scaled_y = direction.y / direction.z * focal_plane_distance;
+    j = fold_j + scaled_x * canvas.width / focal_plane_width;
+    i = fold_i - scaled_y * canvas.height / focal_plane_height;
+    return true;
+}
+
+MemoryStats memory_usage(const Scene &scene) {
+    MemoryStats stats;
+    for (const Mesh &mesh : scene.meshes) {
+        stats += mesh.memory_usage();
+    }
+    return stats;
+}
+
+// The coarsest LOD of the mesh whose error projects to at most pixel_error pixels. The projection uses
+// the point of the mesh's bounding sphere nearest the camera, so the bound holds over the whole mesh.
+int select_lod(const Mesh &mesh, const Camera &camera, const Canvas &canvas, float pixel_error) {
+    // World-space width of one pixel at unit distance from the camera
+    float pixel_angle = camera.focal_plane_width / canvas.width / camera.focal_plane_distance;
+    const BoundingBox &extent = mesh.root.extent;
+    Vec3 center = mesh.position + (extent.llb + extent.urf) / 2;
+    float radius = (extent.urf - extent.llb).magnitude() / 2;
+    float distance = fmax((center - camera.loc).magnitude() - radius, EPS);
+    int lod = 0;
+    for (size_t level = 0; level < mesh.lods.size(); level++) {
+        if (mesh.lods[level].lod_error / (distance * pixel_angle) <= pixel_error) {
+            lod = level + 1;
+        }
+    }
+    return lod;
+}
+
+void print_lod(const Mesh &mesh) {
+    if (!mesh.lods.empty()) {
+        printf("Selected LOD %d of %zu (%zu faces)\n", mesh.active_lod, mesh.lods.size(), mesh.level().faces.size());
+    }
+}
+
+// Set every mesh's active LOD for a render through the scene camera. Negative pixel_error traces full
+// resolution. Every render entry point calls this, so a scene must not be rendered twice at once.
+void select_lods(const Scene &scene, const Canvas &canvas, float pixel_error) {
+    for (const Mesh &mesh : scene.meshes) {
+        mesh.active_lod = pixel_error < 0 ? 0 : select_lod(mesh, scene.camera, canvas, pixel_error);
+        print_lod(mesh);
+    }
+}
+
 LightRay get_reflection(const LightRay &parent, const RaycastResult &hit) {
     LightRay reflection;
     reflection.bounce_count = parent.bounce_count + 1;
@@ -88,114 +148,859 @@ float fresnel(const LightRay &incident, const RaycastResult &hit) {
     }
 }
 
+// Validity radius of a fresh irradiance sample: the harmonic mean distance to the lights, over which
+// their falloff changes appreciably. Ward uses the mean distance to surrounding geometry instead, which
+// needs probe rays per sample and is aimed at indirect light; with point lights the errors come from
+// shadow edges, which max_radius and the gradient bound on insert limit.
+float irradiance_radius(const Scene &scene, float inverse_distances) {
+    return inverse_distances > 0 ? scene.lights.size() / inverse_distances : scene.irradiance->max_radius;
+}
+
+// Whether the mesh blocks the shadow ray toward the light, from the light's shadow maps where they can tell.
+bool occludes(const Scene &scene, const Light &light, size_t mesh_id, const LightRay &shadow_ray) {
+    int verdict = light.visibility ? light.visibility->test(mesh_id, light.loc, shadow_ray.origin) : SHADOW_UNKNOWN;
+    return verdict == SHADOW_UNKNOWN ? scene.meshes[mesh_id].occluded(shadow_ray) : verdict == SHADOW_OCCLUDED;
+}
+
+// Bit of a (light, mesh) pair in a LightVisibilityMask, 0 past the first 64 pairs.
+unsigned long long pair_bit(const Scene &scene, size_t light_id, size_t mesh_id) {
+    size_t pair = light_id * scene.meshes.size() + mesh_id;
+    return pair < 64 ? 1ull << pair : 0;
+}
+
+// Irradiance the light would give the point if nothing were in the way, up to a constant factor.
+float unshadowed(const Light &light, const Vec3 &position, const Vec3 &normal) {
+    Vec3 ray = light.loc - position;
+    float dist = ray.magnitude();
+    return light.intensity.sum() / (dist * dist) * fabs(ray.normalize() ^ normal);
+}
+
+// Shadow rays toward the lights that each give at least the cache's error fraction of the point's
+// unshadowed irradiance. Their hard shadow edges are the errors no validity radius sees coming, so
+// cached samples are only reused where these rays agree.
+LightVisibilityMask dominant_visibility(const Scene &scene, const Vec3 &position, const Vec3 &normal) {
+    float total = 0;
+    for (const Light &light : scene.lights) {
+        total += unshadowed(light, position, normal);
+    }
+    LightVisibilityMask mask;
+    LightRay shadow_ray;
+    shadow_ray.origin = position;
+    for (size_t light_id = 0; light_id < scene.lights.size() && pair_bit(scene, light_id, 0) != 0; light_id++) {
+        const Light &light = scene.lights[light_id];
+        if (unshadowed(light, position, normal) < scene.irradiance->error * total) {
+            continue;
+        }
+        shadow_ray.direction = (light.loc - position).normalize();
+        for (size_t mesh_id = 0; mesh_id < scene.meshes.size(); mesh_id++) {
+            unsigned long long bit = pair_bit(scene, light_id, mesh_id);
+            mask.tested |= bit;
+            if (!occludes(scene, light, mesh_id, shadow_ray)) {
+                mask.visible |= bit;
+            }
+        }
+    }
+    return mask;
+}
+
 Vec3 local_illuminate(const RaycastResult &hit, const Scene &scene) {
     // distance falloff only
     Vec3 total_illumination;
+    LightVisibilityMask tested;
+    if (scene.irradiance) {
+        tested = dominant_visibility(scene, hit.hit_location, hit.normal);
+        if (scene.irradiance->lookup(hit.mesh_id, hit.hit_location, hit.normal, tested, total_illumination)) {
+            return total_illumination * hit.color;
+        }
+    }
+    float inverse_distances = 0;
+    unsigned long long visible = 0;
     LightRay shadow_ray;
     shadow_ray.origin = hit.hit_location;
-    for (const Light &light : scene.lights) {
-
+    for (size_t light_id = 0; light_id < scene.lights.size(); light_id++) {
+        const Light &light = scene.lights[light_id];
         Vec3 ray = (light.loc - hit.hit_location);
         float dist = ray.magnitude();
+        inverse_distances += 1 / dist;
         ray = ray.normalize();
         shadow_ray.direction = ray;
-        for (const Mesh &mesh : scene.meshes) {
-            RaycastResult rr = mesh.raycast(shadow_ray);
-            if (!rr.hit) {
+        for (size_t mesh_id = 0; mesh_id < scene.meshes.size(); mesh_id++) {
+            unsigned long long bit = pair_bit(scene, light_id, mesh_id);
+            bool occluded = (tested.tested & bit) != 0 ? (tested.visible & bit) == 0 : occludes(scene, light, mesh_id, shadow_ray);
+            if (!occluded) {
                 Vec3 intensity = light.intensity / (4 * PI * dist * dist);
                 float lambertian_falloff = fabs(shadow_ray.direction ^ hit.normal);
                 intensity = intensity * lambertian_falloff;
                 total_illumination = total_illumination + intensity;
+                visible |= bit;
             }
         }
     }
+    if (scene.irradiance) {
+        scene.irradiance->insert(hit.mesh_id, hit.hit_location, hit.normal, visible, total_illumination,
+                                 irradiance_radius(scene, inverse_distances));
+    }
     return total_illumination * hit.color;
 }
 
-Vec3 raytrace(const LightRay &ray, const Scene &scene) {
-    if (ray.intensity.sum() < EPS || ray.bounce_count >= scene.camera.max_reflections) {
-        return Vec3(0, 0, 0);
+// Packet counterpart of local_illuminate: the shadow rays from every hit in the packet toward one
+// light are traced together.
+void local_illuminate(const RaycastResult *hits, int count, const Scene &scene, Vec3 *illumination) {
+    // Lanes that need shadow rays: diffuse hits the irradiance cache could not answer
+    bool shaded[PACKET_RAYS];
+    float inverse_distances[PACKET_RAYS];
+    LightVisibilityMask tested[PACKET_RAYS];
+    unsigned long long visible[PACKET_RAYS] = {};
+    for (int k = 0; k < count; k++) {
+        illumination[k] = Vec3();
+        inverse_distances[k] = 0;
+        shaded[k] = hits[k].hit && (hits[k].material & MATERIAL_DIFFUSE) != 0;
+        if (shaded[k] && scene.irradiance) {
+            tested[k] = dominant_visibility(scene, hits[k].hit_location, hits[k].normal);
+            shaded[k] = !scene.irradiance->lookup(hits[k].mesh_id, hits[k].hit_location, hits[k].normal, tested[k], illumination[k]);
+        }
+    }
+    for (size_t light_id = 0; light_id < scene.lights.size(); light_id++) {
+        const Light &light = scene.lights[light_id];
+        RayPacket shadow_rays;
+        float dists[PACKET_RAYS];
+        for (int k = 0; k < count; k++) {
+            Vec3 ray = (light.loc - hits[k].hit_location);
+            dists[k] = ray.magnitude();
+            inverse_distances[k] += 1 / dists[k];
+            shadow_rays.push(hits[k].hit_location, ray.normalize(), shaded[k]);
+        }
+        bool coherent = shadow_rays.coherent();
+        for (size_t mesh_id = 0; mesh_id < scene.meshes.size(); mesh_id++) {
+            const Mesh &mesh = scene.meshes[mesh_id];
+            // Lanes whose ray was already traced for the cache lookup, or that the light's shadow maps can
+            // answer, need no ray
+            RayPacket unresolved = shadow_rays;
+            bool occluded[PACKET_RAYS] = {};
+            unsigned long long bit = pair_bit(scene, light_id, mesh_id);
+            for (int k = 0; k < count; k++) {
+                if (unresolved.active[k] && (tested[k].tested & bit) != 0) {
+                    occluded[k] = (tested[k].visible & bit) == 0;
+                    unresolved.active[k] = false;
+                }
+            }
+            for (int k = 0; light.visibility && k < count; k++) {
+                int verdict = unresolved.active[k] ? light.visibility->test(mesh_id, light.loc, hits[k].hit_location) : SHADOW_UNKNOWN;
+                if (verdict != SHADOW_UNKNOWN) {
+                    occluded[k] = verdict == SHADOW_OCCLUDED;
+                    unresolved.active[k] = false;
+                }
+            }
+            if (coherent) {
+                bool traced[PACKET_RAYS];
+                mesh.occluded(unresolved, traced);
+                for (int k = 0; k < count; k++) {
+                    occluded[k] = unresolved.active[k] ? traced[k] : occluded[k];
+                }
+            } else {
+                for (int k = 0; k < count; k++) {
+                    LightRay shadow_ray;
+                    shadow_ray.origin = Vec3(shadow_rays.ox[k], shadow_rays.oy[k], shadow_rays.oz[k]);
+                    shadow_ray.direction = Vec3(shadow_rays.dx[k], shadow_rays.dy[k], shadow_rays.dz[k]);
+                    occluded[k] = unresolved.active[k] ? mesh.occluded(shadow_ray) : occluded[k];
+                }
+            }
+            for (int k = 0; k < count; k++) {
+                if (shadow_rays.active[k] && !occluded[k]) {
+                    Vec3 intensity = light.intensity / (4 * PI * dists[k] * dists[k]);
+                    float lambertian_falloff = fabs(Vec3(shadow_rays.dx[k], shadow_rays.dy[k], shadow_rays.dz[k]) ^ hits[k].normal);
+                    intensity = intensity * lambertian_falloff;
+                    illumination[k] = illumination[k] + intensity;
+                    visible[k] |= bit;
+                }
+            }
+        }
     }
+    for (int k = 0; k < count; k++) {
+        if (shaded[k] && scene.irradiance) {
+            scene.irradiance->insert(hits[k].mesh_id, hits[k].hit_location, hits[k].normal, visible[k], illumination[k],
+                                     irradiance_radius(scene, inverse_distances[k]));
+        }
+        illumination[k] = illumination[k] * hits[k].color;
+    }
+}
 
-    RaycastResult rr;
-    for (const Mesh &mesh : scene.meshes) {
-        RaycastResult sub_rr = mesh.raycast(ray);
-        if ((!rr.hit && sub_rr.hit) || (rr.hit && sub_rr.hit && sub_rr.dist < rr.dist)) {
-            rr = sub_rr;
+bool is_traceable(const LightRay &ray, const Scene &scene) {
+    return !(ray.intensity.sum() < EPS || ray.bounce_count >= scene.camera.max_reflections);
+}
+
+// Shading specialized per material class, so branches a material cannot take are compiled out and
+// children that would carry no energy are never spawned.
+template <int MATERIAL> Vec3 shade(const LightRay &ray, const RaycastResult &rr, const Vec3 &illumination, const Scene &scene) {
+    Vec3 color;
+    if constexpr ((MATERIAL & MATERIAL_DIFFUSE) != 0) {
+        float diffuse_intensity = rr.matte;
+        color = illumination * ray.intensity * diffuse_intensity;
+    }
+    if constexpr ((MATERIAL & (MATERIAL_REFLECTIVE | MATERIAL_REFRACTIVE)) != 0) {
+        if (ray.bounce_count + 1 >= scene.camera.max_reflections) {
+            return color;
         }
+        float reflection_intensity = fresnel(ray, rr);
+        if constexpr ((MATERIAL & MATERIAL_REFLECTIVE) != 0) {
+            Vec3 intensity = ray.intensity * ray.intensity * reflection_intensity * 0.999 * rr.shiny;
+            if (reflection_intensity >= EPS && intensity.sum() >= EPS) {
+                LightRay reflection = get_reflection(ray, rr);
+                reflection.intensity = intensity;
+                color = color + raytrace(reflection, scene);
+            }
+        }
+        if constexpr ((MATERIAL & MATERIAL_REFRACTIVE) != 0) {
+            float refraction_intensity = 1 - reflection_intensity;
+            Vec3 intensity = ray.intensity * ray.intensity * refraction_intensity * 0.999 * rr.scattering;
+            if (refraction_intensity >= EPS && intensity.sum() >= EPS) {
+                LightRay refraction = get_refraction(ray, rr);
+                refraction.intensity = intensity;
+                color = color + raytrace(refraction, scene);
+            }
+        }
+    }
+    return color;
+}
+
+Vec3 shade(const LightRay &ray, const RaycastResult &rr, const Vec3 &illumination, const Scene &scene) {
+    switch (rr.material) {
+    case MATERIAL_DIFFUSE:
+        return shade<MATERIAL_DIFFUSE>(ray, rr, illumination, scene);
+    case MATERIAL_REFLECTIVE:
+        return shade<MATERIAL_REFLECTIVE>(ray, rr, illumination, scene);
+    case MATERIAL_DIFFUSE | MATERIAL_REFLECTIVE:
+        return shade<MATERIAL_DIFFUSE | MATERIAL_REFLECTIVE>(ray, rr, illumination, scene);
+    case MATERIAL_REFRACTIVE:
+        return shade<MATERIAL_REFRACTIVE>(ray, rr, illumination, scene);
+    case MATERIAL_DIFFUSE | MATERIAL_REFRACTIVE:
+        return shade<MATERIAL_DIFFUSE | MATERIAL_REFRACTIVE>(ray, rr, illumination, scene);
+    case MATERIAL_REFLECTIVE | MATERIAL_REFRACTIVE:
+        return shade<MATERIAL_REFLECTIVE | MATERIAL_REFRACTIVE>(ray, rr, illumination, scene);
+    case MATERIAL_DIFFUSE | MATERIAL_REFLECTIVE | MATERIAL_REFRACTIVE:
+        return shade<MATERIAL_DIFFUSE | MATERIAL_REFLECTIVE | MATERIAL_REFRACTIVE>(ray, rr, illumination, scene);
+    default:
+        return Vec3(0, 0, 0);
     }
-    if (!rr.hit) {
+}
+
+Vec3 raytrace(const LightRay &ray, const Scene &scene) {
+    Hit hit;
+    return raytrace(ray, scene, hit);
+}
+
+// Also reports the closest hit of the ray itself, before any bounces.
+Vec3 raytrace(const LightRay &ray, const Scene &scene, Hit &hit) {
+    hit = Hit();
+    if (!is_traceable(ray, scene)) {
         return Vec3(0, 0, 0);
     }
-    float diffuse_intensity = rr.matte;
-    float reflection_intensity = fresnel(ray, rr);
-    float refraction_intensity = 1 - reflection_intensity;
 
-    Vec3 color = local_illuminate(rr, scene) * ray.intensity * diffuse_intensity;
+    for (size_t mesh_id = 0; mesh_id < scene.meshes.size(); mesh_id++) {
+        scene.meshes[mesh_id].raycast(ray, mesh_id, hit);
+    }
+    if (!hit.hit()) {
+        return Vec3(0, 0, 0);
+    }
+    RaycastResult rr = scene.meshes[hit.mesh_id].resolve(ray, hit);
+    Vec3 illumination = (rr.material & MATERIAL_DIFFUSE) != 0 ? local_illuminate(rr, scene) : Vec3();
+    return shade(ray, rr, illumination, scene);
+}
 
-    if (reflection_intensity >= EPS) {
-        LightRay reflection = get_reflection(ray, rr);
-        reflection.intensity = reflection.intensity * ray.intensity * reflection_intensity * 0.999 * rr.shiny;
-        color = color + raytrace(reflection, scene);
+// Trace up to PACKET_RAYS neighbouring rays together. Incoherent packets fall back to raytrace.
+void raytrace(const LightRay *rays, int count, const Scene &scene, Vec3 *colors, Hit *primary_hits) {
+    RayPacket packet;
+    for (int k = 0; k < count; k++) {
+        packet.push(rays[k].origin, rays[k].direction, is_traceable(rays[k], scene));
     }
-    if (refraction_intensity >= EPS) {
-        LightRay refraction = get_refraction(ray, rr);
-        refraction.intensity = refraction.intensity * ray.intensity * refraction_intensity * 0.999 * rr.scattering;
-        color = color + raytrace(refraction, scene);
+    if (count == 1 || !packet.coherent()) {
+        for (int k = 0; k < count; k++) {
+            Hit hit;
+            colors[k] = raytrace(rays[k], scene, hit);
+            if (primary_hits != nullptr) {
+                primary_hits[k] = hit;
+            }
+        }
+        return;
     }
 
-    return color;
+    Hit hits[PACKET_RAYS];
+    for (size_t mesh_id = 0; mesh_id < scene.meshes.size(); mesh_id++) {
+        scene.meshes[mesh_id].raycast(packet, mesh_id, hits);
+    }
+    RaycastResult rr[PACKET_RAYS];
+    for (int k = 0; k < count; k++) {
+        if (hits[k].hit()) {
+            rr[k] = scene.meshes[hits[k].mesh_id].resolve(rays[k], hits[k]);
+        }
+    }
+    Vec3 illumination[PACKET_RAYS];
+    local_illuminate(rr, count, scene, illumination);
+    for (int k = 0; k < count; k++) {
+        colors[k] = rr[k].hit ? shade(rays[k], rr[k], illumination[k], scene) : Vec3(0, 0, 0);
+    }
+    if (primary_hits != nullptr) {
+        std::copy(hits, hits + count, primary_hits);
+    }
 }
 
 int min(int a, int b) { return a < b ? a : b; }
 
-void subrender(Canvas &canvas, const Scene &scene, vector<int> tile) {
-    for (int id : tile) {
-        LightRay ray = scene.camera.get_initial_ray(canvas, id);
-        int i = id / canvas.width;
-        int j = id % canvas.width;
-        Vec3 color = raytrace(ray, scene);
-        canvas[i][j] = color;
+// Number of pixels from tile[start] on that fall in the same PACKET_SIZE block.
+int packet_length(const Canvas &canvas, const vector<int> &tile, size_t start) {
+    int block_i = tile[start] / canvas.width / PACKET_SIZE;
+    int block_j = tile[start] % canvas.width / PACKET_SIZE;
+    size_t end = start + 1;
+    while (end < tile.size() && end - start < PACKET_RAYS && tile[end] / canvas.width / PACKET_SIZE == block_i &&
+           tile[end] % canvas.width / PACKET_SIZE == block_j) {
+        end++;
+    }
+    return end - start;
+}
+
+void subrender(Canvas &canvas, const Scene &scene, const Camera &camera, const vector<int> &tile) {
+    LightRay rays[PACKET_RAYS];
+    Vec3 colors[PACKET_RAYS];
+    for (size_t start = 0; start < tile.size();) {
+        int count = packet_length(canvas, tile, start);
+        for (int k = 0; k < count; k++) {
+            rays[k] = camera.get_initial_ray(canvas, tile[start + k]);
+        }
+        raytrace(rays, count, scene, colors);
+        for (int k = 0; k < count; k++) {
+            int i = tile[start + k] / canvas.width;
+            int j = tile[start + k] % canvas.width;
+            canvas[i][j] = colors[k];
+        }
+        start += count;
     }
 }
 
-void queue_render(Canvas &canvas, const Scene &scene, queue<vector<int>> &tile_queue, mutex &tile_queue_lock) {
+template <typename T, typename F> void queue_render(queue<T> &tile_queue, mutex &tile_queue_lock, F render_tile) {
     tile_queue_lock.lock();
     while (!tile_queue.empty()) {
-        if (tile_queue.size() % 1 == 0) {
-            printf("Tile queue has %lu tiles remaining...\n", tile_queue.size());
-        }
-        vector<int> tile = tile_queue.front();
+        printf("Tile queue has %lu tiles remaining...\n", tile_queue.size());
+        T tile = std::move(tile_queue.front());
         tile_queue.pop();
         tile_queue_lock.unlock();
-        subrender(canvas, scene, tile);
+        render_tile(tile);
         tile_queue_lock.lock();
     }
     tile_queue_lock.unlock();
 }
 
-void render(Canvas &canvas, const Scene &scene) {
+int worker_count(const RenderOptions &options) { return options.threads > 0 ? options.threads : thread::hardware_concurrency(); }
+
+// Run the tile queue on a set of workers. Tiles are binned by the NUMA node node_of(tile, nodes) picks;
+// pinned workers drain their own node's bin before helping the others. The canvases are placed band by
+// band on the nodes band_node assigns, so node_of should follow the same bands.
+template <typename T, typename N, typename F>
+void run_workers(const vector<Canvas *> &canvases, queue<T> &tile_queue, const Scene &scene, const RenderOptions &options, N node_of,
+                 F render_tile) {
+    int n_workers = worker_count(options);
+    Topology topology = detect_topology();
+    WorkerPlacement placement = place_workers(topology, n_workers, options.affinity, options.cpus);
+    if (placement.nodes > 1) {
+        for (Canvas *canvas : canvases) {
+            place_canvas(*canvas, topology);
+        }
+    }
+
+    vector<queue<T>> node_queues(placement.nodes);
+    vector<mutex> node_locks(placement.nodes);
+    while (!tile_queue.empty()) {
+        node_queues[node_of(tile_queue.front(), placement.nodes)].push(std::move(tile_queue.front()));
+        tile_queue.pop();
+    }
+
+    static bool warned_replicas = false;
+    if (options.replicate_scene && options.affinity == AFFINITY_NONE && !warned_replicas) {
+        fprintf(stderr, "Scene replication needs workers placed on NUMA nodes, ignoring it under AFFINITY_NONE\n");
+        warned_replicas = true;
+    }
+    // Replicas are copied by a thread on the target node so their pages are allocated there
+    vector<std::unique_ptr<Scene>> replicas(placement.nodes);
+    if (options.replicate_scene && placement.nodes > 1) {
+        vector<thread> copiers;
+        for (int node = 0; node < placement.nodes; node++) {
+            copiers.push_back(thread([&, node] {
+                pin_current_thread(topology.node_cpus[node]);
+                replicas[node] = std::make_unique<Scene>(scene);
+            }));
+        }
+        for (thread &copier : copiers) {
+            copier.join();
+        }
+    }
+
+    CacheStats cache_stats;
+    mutex cache_stats_lock;
+    vector<thread> workers;
+    for (int w = 0; w < n_workers; w++) {
+        workers.push_back(thread([&, w] {
+            if (placement.cpus[w] >= 0) {
+                pin_current_thread({placement.cpus[w]});
+            }
+            int home = placement.node[w];
+            const Scene &local_scene = replicas[home] ? *replicas[home] : scene;
+            CacheCounters counters;
+            for (int k = 0; k < placement.nodes; k++) {
+                int node = (home + k) % placement.nodes;
+                queue_render(node_queues[node], node_locks[node], [&](const T &tile) { render_tile(tile, local_scene); });
+            }
+            std::lock_guard<mutex> lock(cache_stats_lock);
+            cache_stats += counters.read();
+        }));
+    }
+    for (thread &worker : workers) {
+        worker.join();
+    }
+    // Unavailable counters stay unavailable, so say so once rather than after every pass
+    static bool reported_unavailable = false;
+    if (cache_stats.available || !reported_unavailable) {
+        cache_stats.print("Render cache");
+        reported_unavailable = !cache_stats.available;
+    }
+}
+
+// Tiles of a single canvas go to the node that owns their band of it.
+template <typename F>
+void run_workers(Canvas &canvas, const Scene &scene, queue<vector<int>> &tile_queue, const RenderOptions &options, F render_tile) {
+    run_workers(
+        {&canvas}, tile_queue, scene, options,
+        [&](const vector<int> &tile, int nodes) { return band_node(tile[0] / canvas.width / CANVAS_TILE_SIZE, canvas.tiles_y, nodes); },
+        render_tile);
+}
+
+// Position of (x, y) along a Hilbert curve filling an n x n grid, n a power of two.
+int hilbert_index(int n, int x, int y) {
+    int d = 0;
+    for (int s = n / 2; s > 0; s /= 2) {
+        int rx = (x & s) > 0;
+        int ry = (y & s) > 0;
+        d += s * s * ((3 * rx) ^ ry);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+// Bits of x and y interleaved, y above x.
+int morton_index(int x, int y) {
+    int d = 0;
+    for (int bit = 0; (x >> bit) > 0 || (y >> bit) > 0; bit++) {
+        d |= ((x >> bit) & 1) << (2 * bit) | ((y >> bit) & 1) << (2 * bit + 1);
+    }
+    return d;
+}
+
+// Split the canvas into tile_size squares of the pixels keep(i, j) accepts. Tiles are issued along a
+// Hilbert curve and pixels within a tile follow a Morton curve, so consecutive work stays spatially
+// close. The Morton order also keeps each aligned PACKET_SIZE block contiguous, for packet_length.
+template <typename F> queue<vector<int>> make_tiles(const Canvas &canvas, int tile_size, F keep) {
+    int tiles_x = (canvas.width + tile_size - 1) / tile_size;
+    int tiles_y = (canvas.height + tile_size - 1) / tile_size;
+    int curve_size = 1;
+    while (curve_size < tiles_x || curve_size < tiles_y) {
+        curve_size *= 2;
+    }
+    vector<std::pair<int, int>> tile_order;
+    for (int ty = 0; ty < tiles_y; ty++) {
+        for (int tx = 0; tx < tiles_x; tx++) {
+            tile_order.push_back({hilbert_index(curve_size, tx, ty), ty * tiles_x + tx});
+        }
+    }
+    std::sort(tile_order.begin(), tile_order.end());
+    vector<std::pair<int, int>> pixel_order;
+    for (int di = 0; di < tile_size; di++) {
+        for (int dj = 0; dj < tile_size; dj++) {
+            pixel_order.push_back({morton_index(dj, di), di * tile_size + dj});
+        }
+    }
+    std::sort(pixel_order.begin(), pixel_order.end());
+
     queue<vector<int>> tile_queue;
-    for (int i = 0; i < canvas.height; i += RENDER_TILE_SIZE) {
-        for (int j = 0; j < canvas.width; j += RENDER_TILE_SIZE) {
-            vector<int> tile;
-            for (int ii = i; ii < min(canvas.height, i + RENDER_TILE_SIZE); ii++) {
-                for (int jj = j; jj < min(canvas.width, j + RENDER_TILE_SIZE); jj++) {
-                    int ind = ii * canvas.width + jj;
-                    // printf("(%d, %d) -> %d\n", ii, jj, ind);
-                    tile.push_back(ind);
-                }
+    for (const auto &ordered_tile : tile_order) {
+        int i = ordered_tile.second / tiles_x * tile_size;
+        int j = ordered_tile.second % tiles_x * tile_size;
+        vector<int> tile;
+        for (const auto &ordered_pixel : pixel_order) {
+            int ii = i + ordered_pixel.second / tile_size;
+            int jj = j + ordered_pixel.second % tile_size;
+            if (ii < canvas.height && jj < canvas.width && keep(ii, jj)) {
+                tile.push_back(ii * canvas.width + jj);
             }
+        }
+        if (!tile.empty()) {
             tile_queue.push(tile);
         }
     }
-    mutex queue_lock;
-    thread workers[256];
-    for (int i = 0; i < thread::hardware_concurrency(); i++) {
-        workers[i] = thread(queue_render, ref(canvas), cref(scene), ref(tile_queue), ref(queue_lock));
+    return tile_queue;
+}
+
+// Keep only pixels on the given lattice. Pixels that also lie on the lattice of skip_stride were
+// traced by an earlier pass.
+queue<vector<int>> make_tiles(const Canvas &canvas, int tile_size, int stride, int skip_stride) {
+    return make_tiles(canvas, tile_size, [stride, skip_stride](int i, int j) {
+        if (i % stride != 0 || j % stride != 0) {
+            return false;
+        }
+        return !(skip_stride > 0 && i % skip_stride == 0 && j % skip_stride == 0);
+    });
+}
+
+// Estimate from a coarse lattice of primary rays how many pixels of the view hit geometry, where nearly
+// all the work is.
+float busy_pixels(const Canvas &canvas, const Scene &scene, const Camera &camera) {
+    int stride = 1;
+    while (canvas.width / stride * (canvas.height / stride) > 1024) {
+        stride *= 2;
+    }
+    int probes = 0, hits = 0;
+    for (int i = stride / 2; i < canvas.height; i += stride) {
+        for (int j = stride / 2; j < canvas.width; j += stride) {
+            LightRay ray = camera.get_initial_ray(canvas, i * canvas.width + j);
+            Hit hit;
+            for (size_t mesh_id = 0; mesh_id < scene.meshes.size(); mesh_id++) {
+                scene.meshes[mesh_id].raycast(ray, mesh_id, hit);
+            }
+            probes++;
+            hits += hit.hit();
+        }
+    }
+    float busy = fmax((float)hits / fmax(probes, 1), 1.0f / RENDER_TILES_PER_WORKER);
+    return canvas.width * canvas.height * busy;
+}
+
+// Largest tile that still gives each worker RENDER_TILES_PER_WORKER tiles of busy pixels. Larger tiles
+// keep more of a thread's rays on the same nodes and triangles.
+int fit_tile_size(float busy_pixels, int workers) {
+    float busy_pixels_per_worker = busy_pixels / fmax(workers, 1);
+    int tile_size = RENDER_MAX_TILE_SIZE;
+    while (tile_size > RENDER_MIN_TILE_SIZE && tile_size * tile_size * RENDER_TILES_PER_WORKER > busy_pixels_per_worker) {
+        tile_size /= 2;
+    }
+    return tile_size;
+}
+
+int tune_tile_size(const Canvas &canvas, const Scene &scene, int workers) {
+    float busy = busy_pixels(canvas, scene, scene.camera);
+    int tile_size = fit_tile_size(busy, workers);
+    printf("Tile size %d (%.0f%% of the image hits geometry, %d workers)\n", tile_size, busy * 100 / (canvas.width * canvas.height),
+           workers);
+    return tile_size;
+}
+
+// Explicit tile sizes round up to a multiple of CANVAS_TILE_SIZE, like the tuned ones.
+int whole_canvas_tiles(int tile_size) { return (tile_size + CANVAS_TILE_SIZE - 1) / CANVAS_TILE_SIZE * CANVAS_TILE_SIZE; }
+
+int resolve_tile_size(const Canvas &canvas, const Scene &scene, const RenderOptions &options) {
+    return options.tile_size > 0 ? whole_canvas_tiles(options.tile_size) : tune_tile_size(canvas, scene, worker_count(options));
+}
+
+// Tile size for renders that cannot afford the tuner's probe rays: progressive renders, whose rays count
+// against a budget and deadline, and temporal frames, which would probe again every frame.
+int untuned_tile_size(const RenderOptions &options) {
+    return options.tile_size > 0 ? whole_canvas_tiles(options.tile_size) : RENDER_MIN_TILE_SIZE;
+}
+
+void render(Canvas &canvas, const Scene &scene) { render(canvas, scene, RenderOptions()); }
+
+void render(Canvas &canvas, const Scene &scene, const RenderOptions &options) {
+    select_lods(scene, canvas, options.lod_pixel_error);
+    queue<vector<int>> tile_queue = make_tiles(canvas, resolve_tile_size(canvas, scene, options), 1, 0);
+    run_workers(canvas, scene, tile_queue, options,
+                [&](const vector<int> &tile, const Scene &local_scene) { subrender(canvas, local_scene, local_scene.camera, tile); });
+    scene.camera.expose(canvas);
+}
+
+struct ViewTile {
+    int view;
+    vector<int> pixels;
+};
+
+// Tiles of every view go through one queue, view after view, so workers move straight on to the next
+// view rather than idling at each frame boundary. Whichever worker finishes the last tile of a view
+// exposes it while the others carry on.
+bool render_views(const vector<Canvas *> &canvases, const vector<Camera> &cameras, const Scene &scene, const RenderOptions &options) {
+    if (canvases.size() != cameras.size()) {
+        fprintf(stderr, "Cannot render %zu views with %zu cameras!\n", canvases.size(), cameras.size());
+        return false;
+    }
+    // Meshes are shared by every view, so each traces the finest level any view needs
+    for (const Mesh &mesh : scene.meshes) {
+        int lod = options.lod_pixel_error < 0 || canvases.empty() ? 0 : mesh.lods.size();
+        for (size_t v = 0; v < canvases.size() && lod > 0; v++) {
+            lod = std::min(lod, select_lod(mesh, cameras[v], *canvases[v], options.lod_pixel_error));
+        }
+        mesh.active_lod = lod;
+        print_lod(mesh);
+    }
+    int workers = worker_count(options);
+    int tile_size = whole_canvas_tiles(options.tile_size);
+    if (tile_size <= 0) {
+        float busy = 0;
+        for (size_t v = 0; v < canvases.size(); v++) {
+            busy += busy_pixels(*canvases[v], scene, cameras[v]);
+        }
+        tile_size = fit_tile_size(busy, workers);
+        printf("Tile size %d for %zu views (%d workers)\n", tile_size, canvases.size(), workers);
+    }
+
+    queue<ViewTile> tile_queue;
+    vector<atomic<int>> remaining(canvases.size());
+    for (size_t v = 0; v < canvases.size(); v++) {
+        queue<vector<int>> view_tiles = make_tiles(*canvases[v], tile_size, 1, 0);
+        remaining[v] = view_tiles.size();
+        if (view_tiles.empty()) {
+            cameras[v].expose(*canvases[v]);
+        }
+        while (!view_tiles.empty()) {
+            tile_queue.push(ViewTile{(int)v, std::move(view_tiles.front())});
+            view_tiles.pop();
+        }
+    }
+    run_workers(
+        canvases, tile_queue, scene, options,
+        [&](const ViewTile &tile, int nodes) {
+            const Canvas &canvas = *canvases[tile.view];
+            return band_node(tile.pixels[0] / canvas.width / CANVAS_TILE_SIZE, canvas.tiles_y, nodes);
+        },
+        [&](const ViewTile &tile, const Scene &local_scene) {
+            subrender(*canvases[tile.view], local_scene, cameras[tile.view], tile.pixels);
+            if (remaining[tile.view].fetch_sub(1) == 1) {
+                cameras[tile.view].expose(*canvases[tile.view]);
+            }
+        });
+    return true;
+}
+
+// Each finished tile is written to the stream before exposure, so the file holds scene radiance and the
+// stream must be PFM or RGBE; 8-bit formats need exposed pixels and go through write_image instead.
+bool render(Canvas &canvas, const Scene &scene, ImageStream &stream, const RenderOptions &options) {
+    if (stream.format != IMAGE_PFM && stream.format != IMAGE_RGBE) {
+        fprintf(stderr, "Streamed renders hold scene radiance and need a PFM or RGBE stream!\n");
+        return false;
+    }
+    if (stream.width != canvas.width || stream.height != canvas.height) {
+        fprintf(stderr, "Cannot stream a %dx%d render into a %dx%d image!\n", canvas.width, canvas.height, stream.width, stream.height);
+        return false;
+    }
+    select_lods(scene, canvas, options.lod_pixel_error);
+    queue<vector<int>> tile_queue = make_tiles(canvas, resolve_tile_size(canvas, scene, options), 1, 0);
+    run_workers(canvas, scene, tile_queue, options, [&](const vector<int> &tile, const Scene &local_scene) {
+        subrender(canvas, local_scene, local_scene.camera, tile);
+        stream.write_tile(canvas, tile);
+    });
+    scene.camera.expose(canvas);
+    return !stream.failed;
+}
+
+struct ProgressiveState {
+    const RenderLimits &limits;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    atomic<long long> rays{0};
+    atomic<bool> stopped{false};
+
+    ProgressiveState(const RenderLimits &limits) : limits(limits) {}
+    float elapsed() const {
+        return std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+    }
+    // Claim one camera ray, or flag the render as stopped if the budget or deadline is exhausted.
+    bool claim_ray() {
+        if (stopped.load(std::memory_order_relaxed)) {
+            return false;
+        }
+        if (elapsed() >= limits.deadline_seconds) {
+            stopped = true;
+            return false;
+        }
+        if (rays.fetch_add(1) >= limits.ray_budget && limits.ray_budget >= 0) {
+            rays--;
+            stopped = true;
+            return false;
+        }
+        return true;
+    }
+};
+
+// Trace each pixel of the tile and splat its color over the stride x stride block it stands in for.
+// Finer passes overwrite the block later, so the canvas is always a complete reconstruction.
+void subrender_progressive(Canvas &canvas, const Scene &scene, const vector<int> &tile, int stride, ProgressiveState &state) {
+    LightRay rays[PACKET_RAYS];
+    Vec3 colors[PACKET_RAYS];
+    for (size_t start = 0; start < tile.size();) {
+        int count = packet_length(canvas, tile, start);
+        int claimed = 0;
+        while (claimed < count && state.claim_ray()) {
+            rays[claimed] = scene.camera.get_initial_ray(canvas, tile[start + claimed]);
+            claimed++;
+        }
+        raytrace(rays, claimed, scene, colors);
+        for (int k = 0; k < claimed; k++) {
+            int i = tile[start + k] / canvas.width;
+            int j = tile[start + k] % canvas.width;
+            for (int ii = i; ii < min(canvas.height, i + stride); ii++) {
+                for (int jj = j; jj < min(canvas.width, j + stride); jj++) {
+                    canvas[ii][jj] = colors[k];
+                }
+            }
+        }
+        if (claimed < count) {
+            return;
+        }
+        start += count;
+    }
+}
+
+RenderProgress render_progressive(Canvas &canvas, const Scene &scene, const RenderLimits &limits, const RenderOptions &options) {
+    ProgressiveState state(limits);
+    RenderProgress progress;
+    int stride = 1;
+    while (stride * 2 <= limits.initial_stride) {
+        stride *= 2;
+    }
+    select_lods(scene, canvas, options.lod_pixel_error);
+    int tiles = untuned_tile_size(options);
+    for (int skip_stride = 0; stride >= 1; skip_stride = stride, stride /= 2) {
+        queue<vector<int>> tile_queue = make_tiles(canvas, tiles, stride, skip_stride);
+        run_workers(canvas, scene, tile_queue, options, [&](const vector<int> &tile, const Scene &local_scene) {
+            subrender_progressive(canvas, local_scene, tile, stride, state);
+        });
+        if (state.stopped) {
+            break;
+        }
+        progress.stride = stride;
+        printf("Progressive pass with stride %d finished after %f seconds\n", stride, state.elapsed());
+    }
+    progress.complete = progress.stride == 1;
+    progress.rays = state.rays;
+    progress.seconds = state.elapsed();
+    scene.camera.expose(canvas);
+    return progress;
+}
+
+// Trace the tile and record each pixel's primary hit in the cache. Pixels of a cold frame start at
+// staggered ages, so their refreshes do not all fall on the same later frame. With refresh_frames of 1
+// or less nothing is ever reused, so there is nothing to stagger.
+void subrender_temporal(const Canvas &canvas, const Scene &scene, const vector<int> &tile, TemporalCache &cache, bool stagger) {
+    LightRay rays[PACKET_RAYS];
+    Vec3 colors[PACKET_RAYS];
+    Hit hits[PACKET_RAYS];
+    for (size_t start = 0; start < tile.size();) {
+        int count = packet_length(canvas, tile, start);
+        for (int k = 0; k < count; k++) {
+            rays[k] = scene.camera.get_initial_ray(canvas, tile[start + k]);
+        }
+        raytrace(rays, count, scene, colors, hits);
+        for (int k = 0; k < count; k++) {
+            int p = tile[start + k];
+            cache.radiance[p] = colors[k];
+            cache.positions[p] = rays[k].origin + rays[k].direction * hits[k].t;
+            cache.depths[p] = hits[k].hit() ? hits[k].t : INFINITY;
+            cache.mesh_ids[p] = hits[k].mesh_id;
+            cache.ages[p] = stagger && cache.refresh_frames > 1 ? (p / canvas.width * 3 + p % canvas.width * 5) % cache.refresh_frames : 0;
+        }
+        start += count;
+    }
+}
+
+// Render one frame of a camera path. The previous frame's primary hits are splatted into the new view,
+// nearest first, and keep their radiance if they are young enough, seen from nearly the same direction,
+// and surrounded by samples of similar depth. Everything else is traced again.
+TemporalFrame render_temporal(Canvas &canvas, const Scene &scene, TemporalCache &cache, const RenderOptions &options) {
+    select_lods(scene, canvas, options.lod_pixel_error);
+    int n = canvas.width * canvas.height;
+    bool warm = cache.width == canvas.width && cache.height == canvas.height;
+    vector<Vec3> radiance(n), positions(n);
+    vector<float> depths(n, INFINITY);
+    vector<int> mesh_ids(n, -1), ages(n, 0);
+    vector<bool> reusable(n, false);
+    for (int p = 0; warm && p < n; p++) {
+        const Vec3 &point = cache.positions[p];
+        float fi, fj;
+        if (cache.mesh_ids[p] < 0 || !scene.camera.project(canvas, point, fi, fj)) {
+            continue;
+        }
+        int i = lround(fi), j = lround(fj);
+        if (i < 0 || i >= canvas.height || j < 0 || j >= canvas.width) {
+            continue;
+        }
+        int q = i * canvas.width + j;
+        float depth = (point - scene.camera.loc).magnitude();
+        if (depth >= depths[q]) {
+            continue;
+        }
+        float view_cosine = (point - cache.camera.loc).normalize() ^ (point - scene.camera.loc).normalize();
+        radiance[q] = cache.radiance[p];
+        positions[q] = point;
+        depths[q] = depth;
+        mesh_ids[q] = cache.mesh_ids[p];
+        ages[q] = cache.ages[p] + 1;
+        reusable[q] = ages[q] < cache.refresh_frames && view_cosine >= cache.min_view_cosine;
+    }
+
+    // A sample well behind one of its neighbours may have leaked through a gap in a nearer surface that
+    // the new view should show. Holes themselves are traced anyway.
+    vector<bool> confident(n, false);
+    for (int i = 0; i < canvas.height; i++) {
+        for (int j = 0; j < canvas.width; j++) {
+            int q = i * canvas.width + j;
+            confident[q] = reusable[q];
+            for (int ii = i - 1; confident[q] && ii <= i + 1; ii++) {
+                for (int jj = j - 1; jj <= j + 1; jj++) {
+                    if (ii < 0 || ii >= canvas.height || jj < 0 || jj >= canvas.width || depths[ii * canvas.width + jj] == INFINITY) {
+                        continue;
+                    }
+                    if (depths[q] - depths[ii * canvas.width + jj] > cache.depth_tolerance * depths[q]) {
+                        confident[q] = false;
+                    }
+                }
+            }
+        }
     }
-    for (int i = 0; i < thread::hardware_concurrency(); i++) {
-        workers[i].join();
+
+    cache.camera = scene.camera;
+    cache.width = canvas.width;
+    cache.height = canvas.height;
+    cache.radiance.swap(radiance);
+    cache.positions.swap(positions);
+    cache.depths.swap(depths);
+    cache.mesh_ids.swap(mesh_ids);
+    cache.ages.swap(ages);
+
+    TemporalFrame frame;
+    queue<vector<int>> tile_queue =
+        make_tiles(canvas, untuned_tile_size(options), [&](int i, int j) { return !confident[i * canvas.width + j]; });
+    run_workers(canvas, scene, tile_queue, options, [&](const vector<int> &tile, const Scene &local_scene) {
+        subrender_temporal(canvas, local_scene, tile, cache, !warm);
+    });
+    for (int i = 0; i < canvas.height; i++) {
+        for (int j = 0; j < canvas.width; j++) {
+            int q = i * canvas.width + j;
+            canvas[i][j] = cache.radiance[q];
+            confident[q] ? frame.reused++ : frame.traced++;
+        }
     }
+    printf("Temporal frame reused %d pixels and traced %d\n", frame.reused, frame.traced);
     scene.camera.expose(canvas);
-}
\ No newline at end of file
+    return frame;
+}
+
+// Forget cached pixels whose primary hit is on mesh_id, or the whole frame for -1, after the scene changes.
+void invalidate(TemporalCache &cache, int mesh_id) {
+    if (mesh_id < 0) {
+        cache.width = cache.height = 0;
+        return;
+    }
+    for (int &pixel_mesh : cache.mesh_ids) {
+        if (pixel_mesh == mesh_id) {
+            pixel_mesh = -1;
+        }
+    }
+}
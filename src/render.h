@@ -3,24 +3,56 @@
 #include "canvas.hpp"
 #include "mesh.h"
 #include "primitive.h"
+#include "topology.h"
+#include <atomic>
+#include <chrono>
 #include <queue>
 #include <thread>
+#include <memory>
 #include <mutex>
 
-using std::queue, std::thread, std::ref, std::cref, std::mutex;
+using std::queue, std::thread, std::ref, std::cref, std::mutex, std::atomic;
 
-const int RENDER_TILE_SIZE = 16;
+const int PROGRESSIVE_INITIAL_STRIDE = 8;
+
+// Largest on-screen deviation, in pixels, a mesh LOD may introduce
+const float LOD_PIXEL_ERROR = 0.5;
+
+// Primary rays are traced in PACKET_SIZE x PACKET_SIZE packets. Packets whose directions spread wider
+// than PACKET_COHERENCE (cosine to the mean direction) fall back to single-ray traversal.
+const int PACKET_SIZE = 4;
+const int PACKET_RAYS = PACKET_SIZE * PACKET_SIZE;
+const float PACKET_COHERENCE = 0.9;
+
+// Render tiles are squares, a power of two between these sizes, picked per render by tune_tile_size.
+// Tiles cover whole canvas tiles, so workers never write to the same cache line.
+const int RENDER_MIN_TILE_SIZE = CANVAS_TILE_SIZE;
+const int RENDER_MAX_TILE_SIZE = 64;
+// Tiles of actual geometry each worker should get at least, so the last tiles do not leave it idle
+const int RENDER_TILES_PER_WORKER = 16;
+
+// Temporal reprojection re-traces a reused pixel once it is this many frames old, bounding drift
+const int TEMPORAL_REFRESH_FRAMES = 8;
+// Reused pixels must see their surface within this angle (cosine) of the direction it was traced from
+const float TEMPORAL_MIN_VIEW_COSINE = 0.995;
+// and must not lie more than this fraction of their depth behind a neighbouring sample
+const float TEMPORAL_DEPTH_TOLERANCE = 0.1;
 
 const int AUTO_LINEAR_EXPOSURE = 0;
 const int AUTO_GAMMA_EXPOSURE = 1;
 const int MANUAL_LINEAR_EXPOSURE = 2;
 
 struct Mesh;
+struct MemoryStats;
 struct LightRay;
+struct Hit;
+struct LightVisibility;
+struct IrradianceCache;
 
 struct Light {
     Vec3 loc;
     Vec3 intensity = Vec3(1, 1, 1);
+    std::shared_ptr<const LightVisibility> visibility; // Optional shadow maps, see build_shadow_maps
     Light(const Vec3 &loc, const Vec3 &intensity) {
         this->loc = loc;
         this->intensity = intensity;
@@ -38,6 +70,7 @@ struct Camera {
     float max_exposure_energy = 55.0f;
     void expose(Canvas &canvas) const;
     LightRay get_initial_ray(const Canvas &canvas, int ray_id) const;
+    bool project(const Canvas &canvas, const Vec3 &point, float &i, float &j) const;
     Camera(){};
     Camera(float focal_distance, float width, float height, float max_exposure)
         : focal_plane_distance(focal_distance), focal_plane_width(width), focal_plane_height(height), max_exposure_energy(max_exposure) {
@@ -59,13 +92,82 @@ struct LightRay {
     bool intersect(const BoundingBox &bbox) const;
 };
 
+// Structure-of-arrays bundle of rays, so box and triangle tests vectorize across rays.
+struct RayPacket {
+    int count = 0;
+    float ox[PACKET_RAYS], oy[PACKET_RAYS], oz[PACKET_RAYS];
+    float dx[PACKET_RAYS], dy[PACKET_RAYS], dz[PACKET_RAYS];
+    bool active[PACKET_RAYS];
+    void push(const Vec3 &origin, const Vec3 &direction, bool is_active);
+    bool coherent() const;
+    void intersect(const BoundingBox &bbox, const bool *mask, bool *hits) const;
+};
+
 struct Scene {
     Camera camera;
     vector<Mesh> meshes;
     vector<Light> lights;
+    std::shared_ptr<IrradianceCache> irradiance; // Optional, reuses diffuse lighting between nearby hits
+};
+
+struct RenderOptions {
+    int threads = 0; // 0 uses every hardware thread
+    int affinity = AFFINITY_NONE;
+    vector<int> cpus; // Worker CPUs for AFFINITY_LIST
+    bool replicate_scene = false; // Give each NUMA node its own copy of the meshes; needs an affinity other than AFFINITY_NONE
+    int tile_size = 0;            // 0 lets tune_tile_size pick one (RENDER_MIN_TILE_SIZE for progressive and temporal renders),
+                                  // others round up to whole canvas tiles
+    float lod_pixel_error = LOD_PIXEL_ERROR; // Screen-space error allowed when picking mesh LODs, negative for full detail
+};
+
+struct RenderLimits {
+    float deadline_seconds = INFINITY; // Wall-clock budget, measured from the start of the render
+    long long ray_budget = -1;         // Maximum number of camera rays, negative for unlimited
+    int initial_stride = PROGRESSIVE_INITIAL_STRIDE; // Pixel spacing of the first pass, rounded down to a power of two
+};
+
+struct RenderProgress {
+    int stride = 0; // Stride of the finest pass that completed, 0 if none did
+    long long rays = 0;
+    float seconds = 0;
+    bool complete = false;
+};
+
+// Primary hits and radiance of the last frame drawn by render_temporal, reprojected into the next one.
+struct TemporalCache {
+    int refresh_frames = TEMPORAL_REFRESH_FRAMES; // 1 or less re-traces every pixel of every frame
+    float min_view_cosine = TEMPORAL_MIN_VIEW_COSINE;
+    float depth_tolerance = TEMPORAL_DEPTH_TOLERANCE;
+
+    Camera camera;
+    int width = 0, height = 0;
+    vector<Vec3> radiance;  // Before exposure
+    vector<Vec3> positions; // World-space primary hits
+    vector<float> depths;   // Distance from the camera, INFINITY for misses
+    vector<int> mesh_ids;   // Mesh of the primary hit, -1 for misses
+    vector<int> ages;       // Frames since the pixel was traced
+};
+
+struct TemporalFrame {
+    int traced = 0;
+    int reused = 0;
 };
 
+MemoryStats memory_usage(const Scene &scene);
+void select_lods(const Scene &scene, const Canvas &canvas, float pixel_error);
+int tune_tile_size(const Canvas &canvas, const Scene &scene, int workers);
 void render(Canvas &canvas, const Scene &scene);
+void render(Canvas &canvas, const Scene &scene, const RenderOptions &options);
+bool render(Canvas &canvas, const Scene &scene, ImageStream &stream, const RenderOptions &options = RenderOptions());
+// Render and expose canvases[v] through cameras[v], all views sharing one set of workers and the scene's
+// shadow maps and irradiance cache. Reflection depth comes from scene.camera.
+bool render_views(const vector<Canvas *> &canvases, const vector<Camera> &cameras, const Scene &scene, const RenderOptions &options);
+RenderProgress render_progressive(Canvas &canvas, const Scene &scene, const RenderLimits &limits,
+                                  const RenderOptions &options = RenderOptions());
+TemporalFrame render_temporal(Canvas &canvas, const Scene &scene, TemporalCache &cache, const RenderOptions &options = RenderOptions());
+void invalidate(TemporalCache &cache, int mesh_id = -1);
 Vec3 raytrace(const LightRay &ray, const Scene &scene);
+Vec3 raytrace(const LightRay &ray, const Scene &scene, Hit &primary_hit);
+void raytrace(const LightRay *rays, int count, const Scene &scene, Vec3 *colors, Hit *primary_hits = nullptr);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,135 @@
+#include "shadow.h"
+
+using std::chrono::steady_clock;
+
+// Faces are ordered +x, -x, +y, -y, +z, -z. Texel (s, t) of a face spans [-1, 1] on its two minor axes.
+int ShadowCubemap::texel(const Vec3 &direction) const {
+    float ax = fabs(direction.x), ay = fabs(direction.y), az = fabs(direction.z);
+    int face;
+    float u, v, major;
+    if (ax >= ay && ax >= az) {
+        face = direction.x > 0 ? 0 : 1, u = direction.y, v = direction.z, major = ax;
+    } else if (ay >= az) {
+        face = direction.y > 0 ? 2 : 3, u = direction.x, v = direction.z, major = ay;
+    } else {
+        face = direction.z > 0 ? 4 : 5, u = direction.x, v = direction.y, major = az;
+    }
+    int s = std::clamp((int)((u / major + 1) / 2 * size), 0, size - 1);
+    int t = std::clamp((int)((v / major + 1) / 2 * size), 0, size - 1);
+    return (face * size + t) * size + s;
+}
+
+Vec3 ShadowCubemap::texel_direction(int face, int s, int t) const {
+    float u = (s + 0.5f) / size * 2 - 1;
+    float v = (t + 0.5f) / size * 2 - 1;
+    float major = face % 2 == 0 ? 1 : -1;
+    switch (face / 2) {
+    case 0:
+        return Vec3(major, u, v).normalize();
+    case 1:
+        return Vec3(u, major, v).normalize();
+    default:
+        return Vec3(u, v, major).normalize();
+    }
+}
+
+// Shadow rays run from the receiver through the light and beyond it, so the mesh occludes if it is
+// between the two, or anywhere past the light on the same line.
+int ShadowCubemap::test(const Vec3 &to_point, float tolerance) const {
+    float distance = to_point.magnitude();
+    int between = texel(to_point);
+    int segment = SHADOW_UNKNOWN;
+    if (distance <= nearest[between] * (1 + tolerance)) {
+        segment = SHADOW_VISIBLE;
+    } else if (distance > farthest[between] * (1 + tolerance)) {
+        segment = SHADOW_OCCLUDED;
+    }
+    int beyond = texel(-to_point);
+    int ray = farthest[beyond] < INFINITY ? SHADOW_OCCLUDED : nearest[beyond] == INFINITY ? SHADOW_VISIBLE : SHADOW_UNKNOWN;
+    if (segment == SHADOW_OCCLUDED || ray == SHADOW_OCCLUDED) {
+        return SHADOW_OCCLUDED;
+    }
+    return segment == SHADOW_VISIBLE && ray == SHADOW_VISIBLE ? SHADOW_VISIBLE : SHADOW_UNKNOWN;
+}
+
+int LightVisibility::test(int mesh_id, const Vec3 &light, const Vec3 &point) const {
+    return meshes[mesh_id].test(point - light, tolerance);
+}
+
+size_t LightVisibility::memory_usage() const {
+    size_t bytes = 0;
+    for (const ShadowCubemap &cubemap : meshes) {
+        bytes += (cubemap.nearest.capacity() + cubemap.farthest.capacity()) * sizeof(float);
+    }
+    return bytes;
+}
+
+// Trace one cube face in PACKET_SIZE blocks of texels and fold each texel's 3x3 neighbourhood.
+void build_face(ShadowCubemap &cubemap, const Mesh &mesh, int mesh_id, const Vec3 &light, int face) {
+    int size = cubemap.size;
+    vector<float> depths(size * size, INFINITY);
+    for (int bt = 0; bt < size; bt += PACKET_SIZE) {
+        for (int bs = 0; bs < size; bs += PACKET_SIZE) {
+            RayPacket packet;
+            int texels[PACKET_RAYS];
+            for (int t = bt; t < std::min(size, bt + PACKET_SIZE); t++) {
+                for (int s = bs; s < std::min(size, bs + PACKET_SIZE); s++) {
+                    texels[packet.count] = t * size + s;
+                    packet.push(light, cubemap.texel_direction(face, s, t), true);
+                }
+            }
+            Hit hits[PACKET_RAYS];
+            mesh.raycast(packet, mesh_id, hits);
+            for (int k = 0; k < packet.count; k++) {
+                depths[texels[k]] = hits[k].t;
+            }
+        }
+    }
+    for (int t = 0; t < size; t++) {
+        for (int s = 0; s < size; s++) {
+            float nearest = INFINITY, farthest = -INFINITY;
+            for (int tt = std::max(0, t - 1); tt <= std::min(size - 1, t + 1); tt++) {
+                for (int ss = std::max(0, s - 1); ss <= std::min(size - 1, s + 1); ss++) {
+                    nearest = fmin(nearest, depths[tt * size + ss]);
+                    farthest = fmax(farthest, depths[tt * size + ss]);
+                }
+            }
+            cubemap.nearest[(face * size + t) * size + s] = nearest;
+            cubemap.farthest[(face * size + t) * size + s] = farthest;
+        }
+    }
+}
+
+// Build a cubemap of every mesh around every light, one pool task per cube face.
+void build_shadow_maps(Scene &scene, ThreadPool &pool, int size, float tolerance) {
+    steady_clock::time_point start = steady_clock::now();
+    vector<std::shared_ptr<LightVisibility>> visibilities;
+    vector<future<void>> faces;
+    for (const Light &light : scene.lights) {
+        auto visibility = std::make_shared<LightVisibility>();
+        visibility->tolerance = tolerance;
+        visibility->meshes.resize(scene.meshes.size());
+        for (size_t mesh_id = 0; mesh_id < scene.meshes.size(); mesh_id++) {
+            ShadowCubemap &cubemap = visibility->meshes[mesh_id];
+            cubemap.size = size;
+            cubemap.nearest.resize(6 * size * size);
+            cubemap.farthest.resize(6 * size * size);
+            for (int face = 0; face < 6; face++) {
+                const Mesh &mesh = scene.meshes[mesh_id];
+                Vec3 loc = light.loc;
+                faces.push_back(pool.submit([&cubemap, &mesh, mesh_id, loc, face] { build_face(cubemap, mesh, mesh_id, loc, face); }));
+            }
+        }
+        visibilities.push_back(visibility);
+    }
+    size_t bytes = 0;
+    for (future<void> &face : faces) {
+        face.get();
+    }
+    for (size_t i = 0; i < scene.lights.size(); i++) {
+        bytes += visibilities[i]->memory_usage();
+        scene.lights[i].visibility = visibilities[i];
+    }
+    printf("Built shadow maps for %zu lights (%.1f KB) in %f seconds\n", scene.lights.size(), bytes / 1024.0,
+           std::chrono::duration<float>(steady_clock::now() - start).count());
+}
@@ -0,0 +1,39 @@
+#ifndef SHADOW_H
+#define SHADOW_H
+
+#include "render.h"
+#include "threadpool.h"
+
+// Texels along each edge of a cubemap face
+const int SHADOW_MAP_SIZE = 64;
+// Occluders closer to the receiver than this fraction of its light distance are ignored, as with any
+// shadow map bias. Receivers whose texel neighbourhood has depths on both sides of them get an exact ray.
+const float SHADOW_MAP_TOLERANCE = 0.02;
+
+const int SHADOW_VISIBLE = 0;
+const int SHADOW_OCCLUDED = 1;
+const int SHADOW_UNKNOWN = 2;
+
+// Omnidirectional depth map of one mesh around a light. Each texel keeps the nearest and farthest hit
+// distance over itself and its neighbours on the face, so lookups can tell when they sit on an edge.
+struct ShadowCubemap {
+    int size = 0;
+    vector<float> nearest, farthest; // INFINITY where no ray hit the mesh
+
+    int texel(const Vec3 &direction) const;
+    Vec3 texel_direction(int face, int s, int t) const;
+    int test(const Vec3 &to_point, float tolerance) const;
+};
+
+// Shadow cubemaps of every mesh around one static light. Geometry or light changes need a rebuild.
+struct LightVisibility {
+    float tolerance = SHADOW_MAP_TOLERANCE;
+    vector<ShadowCubemap> meshes;
+
+    int test(int mesh_id, const Vec3 &light, const Vec3 &point) const;
+    size_t memory_usage() const;
+};
+
+void build_shadow_maps(Scene &scene, ThreadPool &pool, int size = SHADOW_MAP_SIZE, float tolerance = SHADOW_MAP_TOLERANCE);
+
+#endif
@@ -0,0 +1,240 @@
+#include "simplify.h"
+#include <map>
+#include <queue>
+#include <tuple>
+
+using std::map, std::priority_queue, std::tuple;
+
+// Symmetric 4x4 error quadric (Garland & Heckbert), stored as its upper triangle.
+struct Quadric {
+    double a2 = 0, ab = 0, ac = 0, ad = 0, b2 = 0, bc = 0, bd = 0, c2 = 0, cd = 0, d2 = 0;
+    Quadric(){};
+    // Quadric of squared distance to the plane ax + by + cz + d = 0 with (a, b, c) unit length
+    Quadric(double a, double b, double c, double d)
+        : a2(a * a), ab(a * b), ac(a * c), ad(a * d), b2(b * b), bc(b * c), bd(b * d), c2(c * c), cd(c * d), d2(d * d){};
+    void operator+=(const Quadric &q) {
+        a2 += q.a2, ab += q.ab, ac += q.ac, ad += q.ad, b2 += q.b2;
+        bc += q.bc, bd += q.bd, c2 += q.c2, cd += q.cd, d2 += q.d2;
+    }
+    double error(const Vec3 &v) const {
+        double x = v.x, y = v.y, z = v.z;
+        return a2 * x * x + 2 * ab * x * y + 2 * ac * x * z + 2 * ad * x + b2 * y * y + 2 * bc * y * z + 2 * bd * y + c2 * z * z +
+               2 * cd * z + d2;
+    }
+    // Position minimizing the error, if the quadric is well conditioned
+    bool minimize(Vec3 &v) const {
+        double det = a2 * (b2 * c2 - bc * bc) - ab * (ab * c2 - bc * ac) + ac * (ab * bc - b2 * ac);
+        if (fabs(det) < 1e-12) {
+            return false;
+        }
+        double x = -(ad * (b2 * c2 - bc * bc) - ab * (bd * c2 - bc * cd) + ac * (bd * bc - b2 * cd)) / det;
+        double y = -(a2 * (bd * c2 - cd * bc) - ad * (ab * c2 - bc * ac) + ac * (ab * cd - bd * ac)) / det;
+        double z = -(a2 * (b2 * cd - bc * bd) - ab * (ab * cd - bd * ac) + ad * (ab * bc - b2 * ac)) / det;
+        v = Vec3(x, y, z);
+        return true;
+    }
+};
+
+Quadric plane_quadric(const Vec3 &normal, const Vec3 &point) { return Quadric(normal.x, normal.y, normal.z, -(normal ^ point)); }
+
+struct Collapse {
+    double cost;
+    int u, v;
+    unsigned int u_version, v_version;
+    Vec3 target;
+    bool operator<(const Collapse &other) const { return cost > other.cost; }
+};
+
+struct Simplifier {
+    vector<Vec3> positions;
+    vector<Quadric> quadrics;
+    vector<vector<int>> vertex_faces;
+    vector<unsigned int> versions;
+    vector<bool> vertex_alive;
+    vector<Face> faces;
+    vector<bool> face_alive;
+    priority_queue<Collapse> heap;
+
+    Vec3 face_normal(const Face &face) const {
+        Vec3 l = positions[face.v0] - positions[face.v1];
+        Vec3 r = positions[face.v2] - positions[face.v1];
+        return l % r;
+    }
+
+    void push(int u, int v) {
+        Quadric q = quadrics[u];
+        q += quadrics[v];
+        Vec3 target;
+        if (!q.minimize(target)) {
+            // Singular quadric, settle for the best of the endpoints and the midpoint
+            Vec3 candidates[3] = {positions[u], positions[v], (positions[u] + positions[v]) / 2};
+            target = candidates[0];
+            for (const Vec3 &candidate : candidates) {
+                if (q.error(candidate) < q.error(target)) {
+                    target = candidate;
+                }
+            }
+        }
+        heap.push(Collapse{fmax(q.error(target), 0.0), u, v, versions[u], versions[v], target});
+    }
+
+    // A collapse must not fold any surviving face over.
+    bool flips(int moved, int removed, const Vec3 &target) const {
+        for (int f : vertex_faces[moved]) {
+            const Face &face = faces[f];
+            if (!face_alive[f] || face.v0 == removed || face.v1 == removed || face.v2 == removed) {
+                continue;
+            }
+            Vec3 p0 = face.v0 == moved ? target : positions[face.v0];
+            Vec3 p1 = face.v1 == moved ? target : positions[face.v1];
+            Vec3 p2 = face.v2 == moved ? target : positions[face.v2];
+            Vec3 before = face_normal(face).normalize();
+            Vec3 after = ((p0 - p1) % (p2 - p1)).normalize();
+            if ((before ^ after) < SIMPLIFY_MAX_FLIP) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Merge v into u and return the number of faces that degenerated.
+    int collapse(const Collapse &c) {
+        int u = c.u, v = c.v;
+        positions[u] = c.target;
+        quadrics[u] += quadrics[v];
+        vertex_alive[v] = false;
+        versions[u]++;
+        int removed = 0;
+        for (int f : vertex_faces[v]) {
+            if (!face_alive[f]) {
+                continue;
+            }
+            Face &face = faces[f];
+            if (face.v0 == u || face.v1 == u || face.v2 == u) {
+                face_alive[f] = false;
+                removed++;
+                continue;
+            }
+            if (face.v0 == v) face.v0 = u;
+            if (face.v1 == v) face.v1 = u;
+            if (face.v2 == v) face.v2 = u;
+            vertex_faces[u].push_back(f);
+        }
+        vertex_faces[v].clear();
+        return removed;
+    }
+};
+
+// Quadric-error edge collapse down to roughly target_faces faces. Vertices are welded by position first,
+// open edges are held in place by perpendicular constraint planes, and face colors are kept. Returns the
+// square root of the largest collapse error, an upper bound on how far the surface moved.
+float simplify(const vector<Vec3> &vertices, const vector<Face> &faces, int target_faces, vector<Vec3> &out_vertices, vector<Face> &out_faces) {
+    Simplifier s;
+    map<tuple<float, float, float>, int> welded;
+    vector<int> remap(vertices.size());
+    for (size_t i = 0; i < vertices.size(); i++) {
+        auto key = std::make_tuple(vertices[i].x, vertices[i].y, vertices[i].z);
+        auto found = welded.find(key);
+        if (found == welded.end()) {
+            found = welded.insert({key, (int)s.positions.size()}).first;
+            s.positions.push_back(vertices[i]);
+        }
+        remap[i] = found->second;
+    }
+    int n_vertices = s.positions.size();
+    s.quadrics.resize(n_vertices);
+    s.vertex_faces.resize(n_vertices);
+    s.versions.resize(n_vertices, 0);
+    s.vertex_alive.resize(n_vertices, true);
+
+    map<std::pair<int, int>, int> edge_faces;
+    for (const Face &original : faces) {
+        Face face(remap[original.v0], remap[original.v1], remap[original.v2], -1, original.c);
+        Vec3 normal = s.face_normal(face);
+        if (face.v0 == face.v1 || face.v1 == face.v2 || face.v2 == face.v0 || normal.magnitude() < EPS * EPS) {
+            continue;
+        }
+        int f = s.faces.size();
+        s.faces.push_back(face);
+        s.face_alive.push_back(true);
+        Quadric q = plane_quadric(normal.normalize(), s.positions[face.v0]);
+        int corners[3] = {face.v0, face.v1, face.v2};
+        for (int k = 0; k < 3; k++) {
+            s.quadrics[corners[k]] += q;
+            s.vertex_faces[corners[k]].push_back(f);
+            int a = corners[k], b = corners[(k + 1) % 3];
+            edge_faces[{std::min(a, b), std::max(a, b)}]++;
+        }
+    }
+    int alive_faces = s.faces.size();
+
+    // Boundary edges get a plane through the edge, perpendicular to the face, so borders do not shrink
+    for (const Face &face : s.faces) {
+        int corners[3] = {face.v0, face.v1, face.v2};
+        Vec3 normal = s.face_normal(face);
+        for (int k = 0; k < 3; k++) {
+            int a = corners[k], b = corners[(k + 1) % 3];
+            if (edge_faces[{std::min(a, b), std::max(a, b)}] != 1) {
+                continue;
+            }
+            Vec3 edge = s.positions[b] - s.positions[a];
+            Vec3 perpendicular = edge % normal;
+            if (perpendicular.magnitude() < EPS * EPS) {
+                continue;
+            }
+            Quadric q = plane_quadric(perpendicular.normalize(), s.positions[a]);
+            s.quadrics[a] += q;
+            s.quadrics[b] += q;
+        }
+    }
+
+    for (const auto &edge : edge_faces) {
+        s.push(edge.first.first, edge.first.second);
+    }
+
+    double max_error = 0;
+    while (alive_faces > target_faces && !s.heap.empty()) {
+        Collapse c = s.heap.top();
+        s.heap.pop();
+        if (!s.vertex_alive[c.u] || !s.vertex_alive[c.v] || s.versions[c.u] != c.u_version || s.versions[c.v] != c.v_version) {
+            continue;
+        }
+        if (s.flips(c.u, c.v, c.target) || s.flips(c.v, c.u, c.target)) {
+            continue;
+        }
+        alive_faces -= s.collapse(c);
+        max_error = fmax(max_error, c.cost);
+        // Only edges around the merged vertex changed cost
+        set<int> neighbours;
+        for (int f : s.vertex_faces[c.u]) {
+            if (s.face_alive[f]) {
+                neighbours.insert({s.faces[f].v0, s.faces[f].v1, s.faces[f].v2});
+            }
+        }
+        neighbours.erase(c.u);
+        for (int w : neighbours) {
+            s.push(c.u, w);
+        }
+    }
+
+    // Compact the surviving vertices and faces
+    out_vertices.clear();
+    out_faces.clear();
+    vector<int> compact(n_vertices, -1);
+    for (size_t f = 0; f < s.faces.size(); f++) {
+        if (!s.face_alive[f]) {
+            continue;
+        }
+        Face face = s.faces[f];
+        int *corners[3] = {&face.v0, &face.v1, &face.v2};
+        for (int *corner : corners) {
+            if (compact[*corner] < 0) {
+                compact[*corner] = out_vertices.size();
+                out_vertices.push_back(s.positions[*corner]);
+            }
+            *corner = compact[*corner];
+        }
+        out_faces.push_back(face);
+    }
+    return sqrt(max_error);
+}
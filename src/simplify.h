@@ -0,0 +1,11 @@
+#ifndef SIMPLIFY_H
+#define SIMPLIFY_H
+
+#include "mesh.h"
+
+// Collapses are rejected if they turn an adjacent face's normal by more than this (cosine)
+const float SIMPLIFY_MAX_FLIP = 0.2;
+
+float simplify(const vector<Vec3> &vertices, const vector<Face> &faces, int target_faces, vector<Vec3> &out_vertices, vector<Face> &out_faces);
+
+#endif
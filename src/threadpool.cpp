@@ -0,0 +1,43 @@
+#include "threadpool.h"
+
+ThreadPool::ThreadPool(int n_threads) {
+    if (n_threads <= 0) {
+        n_threads = thread::hardware_concurrency();
+    }
+    for (int i = 0; i < n_threads; i++) {
+        workers.push_back(thread([this] {
+            std::unique_lock<mutex> lock(tasks_lock);
+            while (true) {
+                tasks_ready.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty()) {
+                    return;
+                }
+                function<void()> task = std::move(tasks.front());
+                tasks.pop();
+                lock.unlock();
+                task();
+                lock.lock();
+            }
+        }));
+    }
+}
+
+// Queued tasks are finished before the workers exit.
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<mutex> lock(tasks_lock);
+        stopping = true;
+    }
+    tasks_ready.notify_all();
+    for (thread &worker : workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::enqueue(function<void()> task) {
+    {
+        std::lock_guard<mutex> lock(tasks_lock);
+        tasks.push(std::move(task));
+    }
+    tasks_ready.notify_one();
+}
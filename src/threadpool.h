@@ -0,0 +1,37 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+using std::queue, std::thread, std::mutex, std::vector, std::future, std::function;
+
+// Fixed set of worker threads draining a FIFO of tasks.
+struct ThreadPool {
+    vector<thread> workers;
+    queue<function<void()>> tasks;
+    mutex tasks_lock;
+    std::condition_variable tasks_ready;
+    bool stopping = false;
+
+    ThreadPool(int n_threads = 0);
+    ThreadPool(const ThreadPool &) = delete;
+    ~ThreadPool();
+    int size() const { return workers.size(); }
+    void enqueue(function<void()> task);
+
+    template <typename F> auto submit(F fn) -> future<decltype(fn())> {
+        auto task = std::make_shared<std::packaged_task<decltype(fn())()>>(std::move(fn));
+        future<decltype(fn())> result = task->get_future();
+        enqueue([task] { (*task)(); });
+        return result;
+    }
+};
+
+#endif
@@ -0,0 +1,158 @@
+#include "topology.h"
+#include "canvas.hpp"
+#include <sched.h>
+#include <unistd.h>
+#include <thread>
+
+using std::thread;
+
+// Parse a sysfs cpulist such as "0-3,8-11".
+vector<int> parse_cpulist(const char *list) {
+    vector<int> cpus;
+    const char *seek = list;
+    while (*seek != '\0' && *seek != '\n') {
+        char *end;
+        int first = strtol(seek, &end, 10);
+        int last = first;
+        if (end == seek) {
+            break;
+        }
+        if (*end == '-') {
+            seek = end + 1;
+            last = strtol(seek, &end, 10);
+        }
+        for (int cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+        seek = *end == ',' ? end + 1 : end;
+    }
+    return cpus;
+}
+
+Topology detect_topology() {
+    Topology topology;
+    for (int node = 0;; node++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *f = fopen(path, "r");
+        if (f == nullptr) {
+            break;
+        }
+        char list[4096] = {0};
+        if (fgets(list, sizeof(list), f) != nullptr) {
+            vector<int> cpus = parse_cpulist(list);
+            // Memory-only nodes have no CPUs to run workers on
+            if (!cpus.empty()) {
+                topology.node_cpus.push_back(cpus);
+            }
+        }
+        fclose(f);
+    }
+    if (topology.node_cpus.empty()) {
+        // No NUMA information, treat every CPU we may run on as one node
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        sched_getaffinity(0, sizeof(set), &set);
+        topology.node_cpus.push_back(vector<int>());
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set)) {
+                topology.node_cpus[0].push_back(cpu);
+            }
+        }
+    }
+    return topology;
+}
+
+int Topology::node_of(int cpu) const {
+    for (size_t node = 0; node < node_cpus.size(); node++) {
+        for (int c : node_cpus[node]) {
+            if (c == cpu) {
+                return node;
+            }
+        }
+    }
+    return 0;
+}
+
+WorkerPlacement place_workers(const Topology &topology, int n_workers, int affinity, const vector<int> &cpus) {
+    WorkerPlacement placement;
+    placement.nodes = affinity == AFFINITY_NONE ? 1 : topology.node_cpus.size();
+    vector<int> order;
+    switch (affinity) {
+    case AFFINITY_COMPACT:
+        for (const vector<int> &node : topology.node_cpus) {
+            order.insert(order.end(), node.begin(), node.end());
+        }
+        break;
+    case AFFINITY_SCATTER:
+        for (size_t k = 0; order.size() < (size_t)n_workers; k++) {
+            size_t before = order.size();
+            for (const vector<int> &node : topology.node_cpus) {
+                if (k < node.size()) {
+                    order.push_back(node[k]);
+                }
+            }
+            if (order.size() == before) {
+                break;
+            }
+        }
+        break;
+    case AFFINITY_LIST:
+        order = cpus;
+        break;
+    }
+    for (int w = 0; w < n_workers; w++) {
+        int cpu = order.empty() ? -1 : order[w % order.size()];
+        placement.cpus.push_back(cpu);
+        placement.node.push_back(cpu < 0 ? 0 : topology.node_of(cpu));
+    }
+    return placement;
+}
+
+bool pin_current_thread(const vector<int> &cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if (cpu >= 0) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    if (CPU_COUNT(&set) == 0) {
+        return false;
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        fprintf(stderr, "Could not pin thread: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// Rows of tiles are split into one horizontal band per node.
+int band_node(int tile_row, int tile_rows, int nodes) { return (long long)tile_row * nodes / tile_rows; }
+
+// Fault each band of the canvas in from a thread running on the node that will render it, so that
+// first-touch allocation puts the pixels next to their workers. Pages are rewritten with their own
+// contents, so pixels survive and already-placed pages are left where they are.
+void place_canvas(Canvas &canvas, const Topology &topology) {
+    int nodes = topology.node_cpus.size();
+    long page_size = sysconf(_SC_PAGESIZE);
+    vector<thread> placers;
+    for (int node = 0; node < nodes; node++) {
+        placers.push_back(thread([&, node] {
+            pin_current_thread(topology.node_cpus[node]);
+            for (int tile_row = 0; tile_row < canvas.tiles_y; tile_row++) {
+                if (band_node(tile_row, canvas.tiles_y, nodes) == node) {
+                    volatile char *begin = (volatile char *)canvas.tile_row_begin(tile_row);
+                    volatile char *end = (volatile char *)canvas.tile_row_end(tile_row);
+                    for (volatile char *byte = begin; byte < end; byte += page_size) {
+                        *byte = *byte;
+                    }
+                    end[-1] = end[-1];
+                }
+            }
+        }));
+    }
+    for (thread &placer : placers) {
+        placer.join();
+    }
+}
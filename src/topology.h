@@ -0,0 +1,32 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <vector>
+
+using std::vector;
+
+struct Canvas;
+
+const int AFFINITY_NONE = 0;    // Let the OS schedule workers
+const int AFFINITY_COMPACT = 1; // Fill the cores of one NUMA node before moving to the next
+const int AFFINITY_SCATTER = 2; // Deal workers round-robin across NUMA nodes
+const int AFFINITY_LIST = 3;    // Pin worker i to cpus[i % cpus.size()]
+
+struct Topology {
+    vector<vector<int>> node_cpus; // Online CPUs of each NUMA node
+    int node_of(int cpu) const;
+};
+
+struct WorkerPlacement {
+    int nodes = 1;
+    vector<int> cpus;  // CPU each worker is pinned to, -1 for unpinned
+    vector<int> node;  // NUMA node each worker prefers tiles and scene data from
+};
+
+Topology detect_topology();
+WorkerPlacement place_workers(const Topology &topology, int n_workers, int affinity, const vector<int> &cpus);
+bool pin_current_thread(const vector<int> &cpus);
+int band_node(int tile_row, int tile_rows, int nodes);
+void place_canvas(Canvas &canvas, const Topology &topology);
+
+#endif